@@ -11,612 +11,5228 @@
 #include <linux/interrupt.h>
 #include <linux/fs.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include <linux/poll.h>
 #include <linux/init.h>
 #include <linux/io.h>
 #include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/kref.h>
+#include <linux/idr.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/file.h>
+#include <linux/anon_inodes.h>
+#include <linux/uio.h>
 
-#include <asm/hvcall.h>
+#ifdef CONFIG_PPC_PSERIES
 #include <asm/vio.h>
+#endif
 
 #include "ibmvsm.h"
 
+#define CREATE_TRACE_POINTS
+#include "ibmvsm_trace.h"
+
 #define IBMVSM_DRIVER_VERSION "0.1"
 #define MSG_HI	0
 #define MSG_LOW	1
-#define MAX_VTERM 2
-#define MAX_VIO_PUT_CHARS	16
-#define SIZE_VIO_GET_CHARS	16
 
 static const char ibmvsm_driver_name[] = "ibmvsm";
 
-static struct ibmvsm_struct ibmvsm;
-static struct ibmvsm_vterm vterms[MAX_VTERM];
-static struct crq_server_adapter ibmvsm_adapter;
+static unsigned int max_vterms = 256;
+module_param(max_vterms, uint, 0444);
+MODULE_PARM_DESC(max_vterms, "Maximum number of simultaneously open vterms");
 
-enum crq_entry_header {
-	CRQ_FREE = 0x00,
-	CRQ_CMD_RSP = 0x80,
-	CRQ_INIT_MSG = 0xC0
+enum ibmvsm_crq_modes {
+	ibmvsm_crq_tasklet   = 0,
+	ibmvsm_crq_workqueue = 1,
 };
 
-enum crq_init_formats {
-	CRQ_INIT = 0x01,
-	CRQ_INIT_COMPLETE = 0x02
-};
+static unsigned int crq_mode = ibmvsm_crq_tasklet;
+module_param(crq_mode, uint, 0444);
+MODULE_PARM_DESC(crq_mode,
+		 "CRQ processing context: 0 = tasklet, 1 = high priority workqueue");
+
+static unsigned int crq_depth = IBMVSM_CRQ_DEFAULT_DEPTH;
+module_param(crq_depth, uint, 0444);
+MODULE_PARM_DESC(crq_depth,
+		 "CRQ entries, rounded up to a power of two number of pages");
+
+static unsigned int crq_budget = 64;
+module_param(crq_budget, uint, 0644);
+MODULE_PARM_DESC(crq_budget, "CRQ entries processed per pass");
+
+static unsigned int coalesce_irq_rate = 20000;
+module_param(coalesce_irq_rate, uint, 0644);
+MODULE_PARM_DESC(coalesce_irq_rate,
+		 "CRQ interrupts per second above which the CRQ is polled, 0 to never poll");
+
+static unsigned int coalesce_usecs = 50;
+module_param(coalesce_usecs, uint, 0644);
+MODULE_PARM_DESC(coalesce_usecs, "CRQ poll interval in us while coalescing");
+
+static unsigned int coalesce_idle_polls = 8;
+module_param(coalesce_idle_polls, uint, 0644);
+MODULE_PARM_DESC(coalesce_idle_polls,
+		 "Empty CRQ polls in a row before interrupts are turned back on");
+
+/* The CRQ interrupt rate is measured over windows this long */
+#define IBMVSM_COALESCE_WINDOW_NS	(10 * NSEC_PER_MSEC)
+
+static unsigned int tx_backoff_max_ms = 100;
+module_param(tx_backoff_max_ms, uint, 0644);
+MODULE_PARM_DESC(tx_backoff_max_ms,
+		 "Ceiling in ms for the transmit retry backoff after H_BUSY");
+
+static unsigned int history_kb;
+module_param(history_kb, uint, 0644);
+MODULE_PARM_DESC(history_kb,
+		 "Receive history kept per vterm in KB, rounded up to a power of two, at most 1024, 0 for none");
+
+static unsigned int tx_quantum = 4;
+module_param(tx_quantum, uint, 0644);
+MODULE_PARM_DESC(tx_quantum,
+		 "Put chars hcalls per transmit turn of a vterm with weight 1");
+
+static unsigned int tx_budget = 256;
+module_param(tx_budget, uint, 0644);
+MODULE_PARM_DESC(tx_budget,
+		 "Put chars hcalls per transmit scheduler pass");
+
+static struct kmem_cache *ibmvsm_vterm_cache;
+static struct workqueue_struct *ibmvsm_crq_wq;
+static DEFINE_IDA(ibmvsm_ida);
+/* Source of ibmvsm_file_session ids */
+static atomic64_t ibmvsm_session_ids = ATOMIC64_INIT(0);
+static struct dentry *ibmvsm_debugfs_root;
+
+/**
+ * ibmvsm_schedule_crq - Schedule CRQ processing
+ *
+ * @adapter:	crq_server_adapter struct
+ *
+ * Runs ibmvsm_process_crq() from the context selected by crq_mode. Does
+ * nothing once ibmvsm_release_crq_queue() has started.
+ */
+static void ibmvsm_schedule_crq(struct crq_server_adapter *adapter)
+{
+	if (READ_ONCE(adapter->crq_stopped))
+		return;
+
+	if (crq_mode == ibmvsm_crq_workqueue)
+		queue_work(ibmvsm_crq_wq, &adapter->crq_work);
+	else
+		tasklet_schedule(&adapter->work_task);
+}
+
+/**
+ * ibmvsm_sync_crq - Wait for a CRQ processing pass in flight
+ *
+ * @adapter:	crq_server_adapter struct
+ *
+ * Once adapter->state is ibmvsm_state_sched_reset new passes return
+ * without touching the queue, so after this no pass is using it.
+ */
+static void ibmvsm_sync_crq(struct crq_server_adapter *adapter)
+{
+	if (crq_mode == ibmvsm_crq_workqueue) {
+		flush_work(&adapter->crq_work);
+	} else {
+		tasklet_disable(&adapter->work_task);
+		tasklet_enable(&adapter->work_task);
+	}
+}
 
 /**
  * crq_queue_next_crq: - Returns the next entry in message queue
  * @queue:      crq_queue to use
  *
+ * CRQ processing is the only consumer, so entries are dequeued without
+ * locking. The reset task waits out any pass in flight before
+ * ibmvsm_reset_crq_queue() clears the queue. Each entry is handed back
+ * with crq_queue_release_crq() once it is handled.
+ *
  * Returns pointer to next entry in queue, or NULL if there are no new
  * entried in the CRQ.
  */
 static struct ibmvsm_crq_msg *crq_queue_next_crq(struct crq_queue *queue)
 {
-	struct ibmvsm_crq_msg *crq;
-	unsigned long flags;
+	struct ibmvsm_crq_msg *crq = &queue->msgs[queue->cur];
 
-	spin_lock_irqsave(&queue->lock, flags);
-	crq = &queue->msgs[queue->cur];
-	if (crq->valid & 0x80) {
-		if (++queue->cur == queue->size)
-			queue->cur = 0;
+	if (!(READ_ONCE(crq->valid) & 0x80))
+		return NULL;
 
-		/* Ensure the read of the valid bit occurs before reading any
-		 * other bits of the CRQ entry
-		 */
-		dma_rmb();
-	} else {
-		crq = NULL;
-	}
+	/* Ensure the read of the valid bit occurs before reading any
+	 * other bits of the CRQ entry
+	 */
+	dma_rmb();
+
+	/* The previous entry was consumed and cleared before we got
+	 * here. If it is valid again the hypervisor has wrapped the
+	 * whole queue, and messages sent meanwhile may have been lost.
+	 */
+	if (READ_ONCE(queue->msgs[queue->cur ? queue->cur - 1 :
+				  queue->size - 1].valid) & 0x80)
+		queue->full++;
 
-	spin_unlock_irqrestore(&queue->lock, flags);
+	if (++queue->cur == queue->size)
+		queue->cur = 0;
 
 	return crq;
 }
 
+/**
+ * crq_queue_release_crq: - Hand a handled entry back to the hypervisor
+ * @crq:	entry returned by crq_queue_next_crq()
+ */
+static void crq_queue_release_crq(struct ibmvsm_crq_msg *crq)
+{
+	/* Finish reading the entry before the hypervisor may refill it. The
+	 * hypervisor is another agent even on a UP kernel, hence virt_.
+	 */
+	virt_store_release(&crq->valid, 0x00);
+}
+
 /**
  * ibmvsm_send_init_message() - send initialization message to the client
  */
 static long ibmvsm_send_init_msg(struct crq_server_adapter *adapter, u8 type)
 {
 	struct ibmvsm_crq_msg *crq;
-	struct vio_dev *vdev = to_vio_dev(adapter->dev);
 	u64 buffer[2] = { 0 , 0 };
 	long rc;
 
 	crq = (struct ibmvsm_crq_msg *)&buffer;
 	crq->valid = CRQ_INIT_MSG;
 	crq->type = type;
-	rc = h_send_crq(vdev->unit_address,
+	rc = h_send_crq(adapter,
 			cpu_to_be64(buffer[MSG_HI]),
 			cpu_to_be64(buffer[MSG_LOW]));
 
 	return rc;
 }
 
+/* Largest get/put chars transfer this driver and backend can handle */
+static u32 ibmvsm_local_max_chars(struct crq_server_adapter *adapter)
+{
+	return min_t(u32, adapter->ops->max_chars, IBMVSM_MAX_CHARS);
+}
+
+/**
+ * ibmvsm_send_version - Start the version exchange
+ *
+ * @adapter:	crq_server_adapter struct
+ *
+ * Offers the partner our protocol version, transfer size and vterm table
+ * size. The partner answers with VSM_MSG_VERSION_EXCH_RSP.
+ */
+static long ibmvsm_send_version(struct crq_server_adapter *adapter)
+{
+	struct ibmvsm_crq_version *crq;
+	u64 buffer[2] = { 0, 0 };
+
+	crq = (struct ibmvsm_crq_version *)&buffer;
+	crq->valid = CRQ_CMD_RSP;
+	crq->type = VSM_MSG_VER_EXCH;
+	crq->version = cpu_to_be16(IBMVSM_PROTOCOL_VERSION);
+	crq->max_chars = cpu_to_be16(ibmvsm_local_max_chars(adapter));
+	crq->max_vterms = cpu_to_be16(min_t(u32, adapter->nr_vterms, U16_MAX));
+
+	return h_send_crq(adapter,
+			  cpu_to_be64(buffer[MSG_HI]),
+			  cpu_to_be64(buffer[MSG_LOW]));
+}
+
+/**
+ * ibmvsm_adapter_stat_add - Bump an adapter counter
+ *
+ * @adapter:	crq_server_adapter struct
+ * @item:	counter to bump
+ * @val:	amount to add
+ */
+static void ibmvsm_adapter_stat_add(struct crq_server_adapter *adapter,
+				    enum ibmvsm_stat_item item, u64 val)
+{
+	this_cpu_add(adapter->stats->count[item], val);
+}
+
+/**
+ * ibmvsm_stat_add - Bump a vterm counter
+ *
+ * @vterm:	ibmvsm_vterm struct, must be open
+ * @item:	counter to bump
+ * @val:	amount to add
+ *
+ * Counts against both the vterm's session and its adapter.
+ */
+static void ibmvsm_stat_add(struct ibmvsm_vterm *vterm,
+			    enum ibmvsm_stat_item item, u64 val)
+{
+	this_cpu_add(vterm->stats->count[item], val);
+	ibmvsm_adapter_stat_add(vterm->adapter, item, val);
+}
+
+/**
+ * ibmvsm_stat_lat - Record an hcall latency
+ *
+ * @vterm:	ibmvsm_vterm struct, must be open
+ * @item:	histogram to update
+ * @start:	ktime_get_ns() taken before the hcall
+ */
+static void ibmvsm_stat_lat(struct ibmvsm_vterm *vterm,
+			    enum ibmvsm_lat_item item, u64 start)
+{
+	u64 ns = ktime_get_ns() - start;
+	unsigned int bucket;
+
+	bucket = ns ? min_t(unsigned int, ilog2(ns), IBMVSM_LAT_BUCKETS - 1) : 0;
+	this_cpu_inc(vterm->stats->lat[item][bucket]);
+	this_cpu_inc(vterm->adapter->stats->lat[item][bucket]);
+}
+
 /**
- * ibmvsm_get_chars - retrieve characters from firmware for denoted vterm adapter
- * @adapter: point to the crq server adapter
+ * ibmvsm_get_chars - retrieve characters from firmware for denoted vterm
+ * @vterm: the open vterm to read from
  * @buf: The character buffer into which to put the character data fetched from
- *	firmware.
+ *	firmware, IBMVSM_MAX_CHARS bytes.
+ * @max: Negotiated bytes per hcall, the most that is returned.
  */
-static long ibmvsm_get_chars(struct crq_server_adapter *adapter, u64 tok, char *buf)
+static long ibmvsm_get_chars(struct ibmvsm_vterm *vterm, char *buf, u32 max)
 {
-	struct vio_dev *vdev = to_vio_dev(adapter->dev);
-	unsigned long retbuf[PLPAR_HCALL_BUFSIZE];
-	unsigned long *lbuf = (unsigned long *)buf;
+	unsigned long len = 0;
+	u64 start;
 	long rc;
 
-	rc = h_get_term_char_lp(retbuf, vdev->unit_address, tok);
-	lbuf[MSG_HI] = be64_to_cpu(retbuf[1]);
-	lbuf[MSG_LOW] = be64_to_cpu(retbuf[2]);
+	start = ktime_get_ns();
+	rc = h_get_term_char_lp(vterm->adapter, vterm->console_token, buf,
+				&len);
 
 	if (rc == H_SUCCESS)
-		return retbuf[0];
+		len = min_t(unsigned long, len, max);
+	else
+		len = 0;
 
-	return 0;
+	ibmvsm_stat_lat(vterm, IBMVSM_LAT_GET_CHARS, start);
+	ibmvsm_stat_add(vterm, IBMVSM_STAT_GET_CHARS, 1);
+	trace_hcall_get_chars(vterm, rc, len, ktime_get_ns() - start);
+
+	return len;
 }
 
 /**
- * ibmvsm_put_chars: send characters to firmware for denoted vterm adapter
- * @adapter: point to the crq server adapter
+ * ibmvsm_put_chars: send characters to firmware for denoted vterm
+ * @vterm: the open vterm to write to
  * @buf: The character buffer that contains the character data to send to
  *	firmware.
  * @count: Send this number of characters.
  */
-static long ibmvsm_put_chars(struct crq_server_adapter *adapter, u64 tok,
-			     const char *buf, int count)
+static long ibmvsm_put_chars(struct ibmvsm_vterm *vterm, const char *buf,
+			     int count)
 {
-	struct vio_dev *vdev = to_vio_dev(adapter->dev);
-	unsigned long *lbuf = (unsigned long *) buf;
 	long rc;
-
+	u64 start;
 
 	/* hcall will ret H_PARAMETER if 'count' exceeds firmware max.*/
-	if (count > MAX_VIO_PUT_CHARS)
-		count = MAX_VIO_PUT_CHARS;
+	count = min_t(int, count, READ_ONCE(vterm->adapter->max_chars));
 
-	rc = h_put_term_char_lp(vdev->unit_address, tok, count,
-				cpu_to_be64(lbuf[MSG_HI]),
-				cpu_to_be64(lbuf[MSG_LOW]));
+	start = ktime_get_ns();
+	rc = h_put_term_char_lp(vterm->adapter, vterm->console_token, buf,
+				count);
+
+	ibmvsm_stat_lat(vterm, IBMVSM_LAT_PUT_CHARS, start);
+	ibmvsm_stat_add(vterm, IBMVSM_STAT_PUT_CHARS, 1);
+	trace_hcall_put_chars(vterm, rc, count, ktime_get_ns() - start);
 
 	if (rc == H_SUCCESS)
 		return count;
-	if (rc == H_BUSY)
+	if (rc == H_BUSY || H_IS_LONG_BUSY(rc))
 		return -EAGAIN;
 	return -EIO;
 }
 
 /**
- * ibmvsm_read - Read
+ * ibmvsm_ring_alloc - Allocate ring buffer
  *
- * @file:	file struct
- * @buf:	character buffer
- * @nbytes:	size in bytes
- * @ppos:	offset
+ * @ring:	ibmvsm_ring struct
+ * @ctrl:	indices of the ring
+ * @size:	ring size in bytes, must be a power of two
+ *
+ * The buffer comes from vmalloc_user() so the session can map it.
  *
  * Return:
  *	0 - Success
  *	Non-zero - Failure
  */
-static ssize_t ibmvsm_read(struct file *file, char *buf, size_t nbytes,
-			   loff_t *ppos)
+static int ibmvsm_ring_alloc(struct ibmvsm_ring *ring,
+			     struct ibmvsm_ring_ctrl *ctrl, u32 size)
 {
+	ring->buf = vmalloc_user(size);
+	if (!ring->buf)
+		return -ENOMEM;
+
+	ring->size = size;
+	ring->ctrl = ctrl;
+	ctrl->head = 0;
+	ctrl->tail = 0;
+	ctrl->size = size;
+	ctrl->flags = 0;
+
 	return 0;
 }
 
+/* Pages still mapped by the session are freed once it unmaps them */
+static void ibmvsm_ring_free(struct ibmvsm_ring *ring)
+{
+	vfree(ring->buf);
+	ring->buf = NULL;
+	ring->size = 0;
+	ring->ctrl = NULL;
+}
+
+static bool ibmvsm_ring_empty(struct ibmvsm_ring *ring)
+{
+	return READ_ONCE(ring->ctrl->head) == READ_ONCE(ring->ctrl->tail);
+}
+
+/*
+ * Producer side: bytes that can be added at @head without overwriting
+ * unread data
+ */
+static u32 ibmvsm_ring_space(struct ibmvsm_ring *ring, u32 head)
+{
+	u32 used = head - smp_load_acquire(&ring->ctrl->tail);
+
+	/* A consumer mapping the ring may have put tail anywhere */
+	return used < ring->size ? ring->size - used : 0;
+}
+
 /**
- * ibmvsm_write - Write
+ * ibmvsm_ring_put - Append data to a ring (producer side)
  *
- * @file:	file struct
- * @buf:	character buffer
- * @count:	count field
- * @ppos:	offset
+ * @ring:	ibmvsm_ring struct
+ * @head:	the producer's own copy of head, never read back from ctrl
+ * @data:	bytes to append
+ * @len:	number of bytes, must not exceed ibmvsm_ring_space()
  *
  * Return:
- *	0 - Success
- *	Non-zero - Failure
+ *	The new head, also published in ctrl
  */
-static ssize_t ibmvsm_write(struct file *file, const char *buffer,
-			    size_t count, loff_t *ppos)
+static u32 ibmvsm_ring_put(struct ibmvsm_ring *ring, u32 head,
+			   const char *data, u32 len)
 {
-	return 0;
+	u32 off = head & (ring->size - 1);
+	u32 first = min(len, ring->size - off);
+
+	memcpy(ring->buf + off, data, first);
+	memcpy(ring->buf, data + first, len - first);
+
+	/* Make the data visible before the consumer can see the new head */
+	smp_store_release(&ring->ctrl->head, head + len);
+
+	return head + len;
 }
 
 /**
- * ibmvsm_poll - Poll
+ * ibmvsm_ring_to_iter - Copy unread data out of a ring (consumer side)
  *
- * @file:	file struct
- * @wait:	Poll Table
+ * @ring:	ibmvsm_ring struct
+ * @to:		destination iov_iter
+ *
+ * Copies each contiguous run of the ring with a single copy_to_iter,
+ * which spreads it over as many iovec segments as it needs. Only the
+ * bytes that made it out are consumed.
  *
  * Return:
- *	poll.h return values
+ *	Number of bytes copied, or -EFAULT if none could be
  */
-static unsigned int ibmvsm_poll(struct file *file, poll_table *wait)
+static ssize_t ibmvsm_ring_to_iter(struct ibmvsm_ring *ring,
+				   struct iov_iter *to)
 {
-	return 0;
+	u32 tail = READ_ONCE(ring->ctrl->tail);
+	u32 off = tail & (ring->size - 1);
+	size_t copied;
+	u32 len, first;
+
+	/* A producer mapping the ring may have put head anywhere */
+	len = min(smp_load_acquire(&ring->ctrl->head) - tail, ring->size);
+	len = min_t(size_t, iov_iter_count(to), len);
+	first = min(len, ring->size - off);
+
+	copied = copy_to_iter(ring->buf + off, first, to);
+	if (copied == first)
+		copied += copy_to_iter(ring->buf, len - first, to);
+	if (!copied && len)
+		return -EFAULT;
+
+	/* Finish reading the data before the producer may reuse it */
+	smp_store_release(&ring->ctrl->tail, tail + copied);
+
+	return copied;
+}
+
+/* Consumer side: bytes available to read past @tail */
+static u32 ibmvsm_ring_avail(struct ibmvsm_ring *ring, u32 tail)
+{
+	/* A producer mapping the ring may have put head anywhere */
+	return min(smp_load_acquire(&ring->ctrl->head) - tail, ring->size);
+}
+
+static u32 ibmvsm_ring_used(struct ibmvsm_ring *ring)
+{
+	return ibmvsm_ring_avail(ring, READ_ONCE(ring->ctrl->tail));
+}
+
+static bool ibmvsm_ring_full(struct ibmvsm_ring *ring)
+{
+	return READ_ONCE(ring->ctrl->head) - READ_ONCE(ring->ctrl->tail) >=
+	       ring->size;
 }
 
 /**
- * ibmvsm_ioctl_setid - IOCTL set HMC ID
+ * ibmvsm_ring_from_iter - Append user data to a ring (producer side)
  *
- * @session: ibmvsm_file_session struct
- * @new_hmc_id: HMC id field
+ * @ring:	ibmvsm_ring struct
+ * @from:	source iov_iter
  *
- * IOCTL command to setup the hmc id
+ * Copies as much of @from as fits, one copy_from_iter per contiguous run.
+ * Only the bytes that made it in are published. write() produces on
+ * behalf of the session, which owns head and may as well advance it
+ * through the mapping, so head is taken from ctrl; masked, it only ever
+ * indexes the session's own buffer.
  *
  * Return:
- * 	0 - Success
- * 	Non-zero - Failure
+ *	Number of bytes copied, or -EFAULT if none could be
  */
-static long ibmvsm_ioctl_setid(struct ibmvsm_file_session *session,
-			       unsigned char __user *new_hmc_id)
+static ssize_t ibmvsm_ring_from_iter(struct ibmvsm_ring *ring,
+				     struct iov_iter *from)
 {
-	/* Reserve HMC session */
+	u32 head = READ_ONCE(ring->ctrl->head);
+	u32 off = head & (ring->size - 1);
+	size_t copied;
+	u32 len, first;
 
-	/* Make sure Version exchange is done first */
+	len = min_t(size_t, iov_iter_count(from),
+		    ibmvsm_ring_space(ring, head));
+	first = min(len, ring->size - off);
 
-	/* Send H_OPEN_VTERM_LP */
-	return 0;
+	copied = copy_from_iter(ring->buf + off, first, from);
+	if (copied == first)
+		copied += copy_from_iter(ring->buf, len - first, from);
+	if (!copied && len)
+		return -EFAULT;
+
+	smp_store_release(&ring->ctrl->head, head + copied);
+
+	return copied;
 }
 
 /**
- * ibmvsm_ioctl - IOCTL
+ * ibmvsm_ring_peek - Copy unread data out of a ring without consuming it
  *
- * @session:	ibmvsm_file_session struct
- * @cmd:	cmd field
- * @arg:	Argument field
+ * @ring:	ibmvsm_ring struct
+ * @tail:	the consumer's own copy of tail, never read back from ctrl
+ * @data:	destination buffer
+ * @len:	maximum number of bytes to copy
  *
  * Return:
- *	0 - Success
- *	Non-zero - Failure
+ *	Number of bytes copied
  */
-static long ibmvsm_ioctl(struct file *file,
-			 unsigned int cmd, unsigned long arg)
+static u32 ibmvsm_ring_peek(struct ibmvsm_ring *ring, u32 tail, char *data,
+			    u32 len)
 {
-	struct ibmvsm_file_session *session = file->private_data;
+	u32 off = tail & (ring->size - 1);
+	u32 first;
 
-	pr_debug("ibmvsm: ioctl file=0x%lx, cmd=0x%x, arg=0x%lx, ses=0x%lx\n",
-		 (unsigned long)file, cmd, arg,
-		 (unsigned long)session);
+	len = min(len, ibmvsm_ring_avail(ring, tail));
+	first = min(len, ring->size - off);
 
-	if (!session) {
-		pr_warn("ibmvsm: ioctl: no session\n");
-		return -EIO;
-	}
+	memcpy(data, ring->buf + off, first);
+	memcpy(data + first, ring->buf, len - first);
 
-	switch (cmd) {
-	case VSM_IOCTL_SETID:
-		return ibmvsm_ioctl_setid(session,
-				(unsigned char __user *)arg);
-	default:
-		pr_warn("ibmvsm: unknown ioctl 0x%x\n", cmd);
-		return -EINVAL;
-	}
+	return len;
+}
+
+/*
+ * Consumer side: release @len bytes past @tail previously returned by
+ * ibmvsm_ring_peek(). Returns the new tail, also published in ctrl.
+ */
+static u32 ibmvsm_ring_consume(struct ibmvsm_ring *ring, u32 tail, u32 len)
+{
+	smp_store_release(&ring->ctrl->tail, tail + len);
+
+	return tail + len;
 }
 
 /**
- * ibmvsm_open - Open Session
+ * ibmvsm_ring_filled - Check for an empty to non-empty transition
  *
- * @inode:	inode struct
- * @file:	file struct
+ * @ring:	ibmvsm_ring struct
+ * @start:	head before the producer added its batch
+ * @head:	the producer's own copy of head after the batch
+ *
+ * Producer side. A reader only sleeps on an empty ring, so it needs a
+ * wakeup only if it had caught up to a head published during this batch.
  *
  * Return:
- *	0 - Success
+ *	true if the consumer may be waiting for the data just added
  */
-static int ibmvsm_open(struct inode *inode, struct file *file)
+static bool ibmvsm_ring_filled(struct ibmvsm_ring *ring, u32 start, u32 head)
 {
-	struct ibmvsm_file_session *session;
-	int rc = 0;
+	/* Order the new head before reading tail, pairs with the barrier in
+	 * the reader's prepare_to_wait()
+	 */
+	smp_mb();
+	return READ_ONCE(ring->ctrl->tail) - start < head - start;
+}
 
-	pr_debug("%s: inode = 0x%lx, file = 0x%lx, state = 0x%x\n", __func__,
-		 (unsigned long)inode, (unsigned long)file,
-		 ibmvsm.state);
+/**
+ * ibmvsm_ring_drained - Check for a full to non-full transition
+ *
+ * @ring:	ibmvsm_ring struct
+ * @start:	tail before the consumer released its batch
+ * @tail:	the consumer's own copy of tail after the batch
+ *
+ * Consumer side counterpart of ibmvsm_ring_filled().
+ *
+ * Return:
+ *	true if the producer may be waiting for the space just released
+ */
+static bool ibmvsm_ring_drained(struct ibmvsm_ring *ring, u32 start, u32 tail)
+{
+	smp_mb();
+	return READ_ONCE(ring->ctrl->head) - ring->size - start < tail - start;
+}
 
-	session = kzalloc(sizeof(*session), GFP_KERNEL);
-	session->file = file;
-	file->private_data = session;
+/**
+ * ibmvsm_vterm_alive - Check a vterm is open from its session's view
+ *
+ * @vterm:	ibmvsm_vterm struct
+ *
+ * A vterm suspended by a CRQ reset keeps its rings and is reopened once
+ * the CRQ is back, so file operations treat it as open. Only ready vterms
+ * make hcalls.
+ */
+static bool ibmvsm_vterm_alive(struct ibmvsm_vterm *vterm)
+{
+	u32 state = READ_ONCE(vterm->state);
 
-	return rc;
+	return state == ibmvterm_state_ready ||
+	       state == ibmvterm_state_suspended;
 }
 
 /**
- * ibmvsm_close - Close Session
+ * ibmvsm_history_alloc - Allocate a vterm's receive history
  *
- * @inode:	inode struct
- * @file:	file struct
+ * @vterm:	ibmvsm_vterm struct, being opened
+ *
+ * Sized from history_kb when the vterm is opened. A vterm that would take
+ * the adapter past IBMVSM_HISTORY_ADAPTER_MAX_KB opens without a history.
+ * Must be called with adapter->vterm_mutex held.
  *
  * Return:
  *	0 - Success
  *	Non-zero - Failure
  */
-static int ibmvsm_close(struct inode *inode, struct file *file)
+static int ibmvsm_history_alloc(struct ibmvsm_vterm *vterm)
 {
-	struct ibmvsm_file_session *session;
-	int rc = 0;
+	struct crq_server_adapter *adapter = vterm->adapter;
+	unsigned int kb = min(READ_ONCE(history_kb), IBMVSM_HISTORY_MAX_KB);
 
-	pr_debug("%s: file = 0x%lx, state = 0x%x\n", __func__,
-		 (unsigned long)file, ibmvsm.state);
+	if (!kb)
+		return 0;
 
-	session = file->private_data;
-	if (!session)
-		return -EIO;
+	kb = roundup_pow_of_two(kb);
+	if (adapter->history_kb + kb > IBMVSM_HISTORY_ADAPTER_MAX_KB) {
+		dev_warn_ratelimited(adapter->dev,
+				     "history limit reached, vterm %u opened without one\n",
+				     vterm->index);
+		return 0;
+	}
 
-	/* Do ibmvsm session specific stuff like check if vsm adapter
-	 * available if not return -EIO, check if state is failed.
-	 * if failed state then return -EIO. Then check if vsm state
-	 * is trying to open again if so then close it.
-	 */
+	vterm->history_size = kb * 1024;
+	vterm->history = vmalloc(vterm->history_size);
+	if (!vterm->history) {
+		vterm->history_size = 0;
+		return -ENOMEM;
+	}
+	vterm->history_head = 0;
+	adapter->history_kb += kb;
 
-	kzfree(session);
+	return 0;
+}
 
-	return rc;
+/* Must be called with adapter->vterm_mutex held */
+static void ibmvsm_history_free(struct ibmvsm_vterm *vterm)
+{
+	vterm->adapter->history_kb -= vterm->history_size / 1024;
+	vfree(vterm->history);
+	vterm->history = NULL;
+	vterm->history_size = 0;
+	vterm->history_head = 0;
 }
 
-static const struct file_operations ibmvsm_fops = {
-	.owner		= THIS_MODULE,
-	.read		= ibmvsm_read,
-	.write		= ibmvsm_write,
-	.poll		= ibmvsm_poll,
-	.unlocked_ioctl	= ibmvsm_ioctl,
-	.open           = ibmvsm_open,
-	.release        = ibmvsm_close,
-};
+/* Append received data, overwriting the oldest. Under vterm->lock. */
+static void ibmvsm_history_put(struct ibmvsm_vterm *vterm, const char *data,
+			       u32 len)
+{
+	u32 off, first;
+
+	if (!vterm->history)
+		return;
+
+	off = vterm->history_head & (vterm->history_size - 1);
+	first = min(len, vterm->history_size - off);
+	memcpy(vterm->history + off, data, first);
+	memcpy(vterm->history, data + first, len - first);
+	vterm->history_head += len;
+}
+
+/*
+ * Append @len bytes that receive just put in the ring at @start. Under
+ * vterm->lock.
+ */
+static void ibmvsm_history_put_ring(struct ibmvsm_vterm *vterm, u32 start,
+				    u32 len)
+{
+	struct ibmvsm_ring *ring = &vterm->rx;
+	u32 off = start & (ring->size - 1);
+	u32 first = min(len, ring->size - off);
+
+	ibmvsm_history_put(vterm, ring->buf + off, first);
+	ibmvsm_history_put(vterm, ring->buf, len - first);
+}
 
-/* routines for managing a command/response queue */
 /**
- * ibmvsm_handle_event: - Interrupt handler for crq events
- * @irq:        number of irq to handle, not used
- * @dev_instance: crq_server_adapter that received interrupt
+ * ibmvsm_history_get - Copy out the most recent history
  *
- * Disables interrupts and schedules ibmvsm_task
+ * @vterm:	ibmvsm_vterm struct
+ * @buf:	kernel buffer
+ * @len:	size of @buf
  *
- * Always returns IRQ_HANDLED
+ * Must be called with vterm->lock held.
+ *
+ * Return:
+ *	Number of bytes copied, oldest first
  */
-static irqreturn_t ibmvsm_handle_event(int irq, void *dev_instance)
+static u32 ibmvsm_history_get(struct ibmvsm_vterm *vterm, char *buf, u32 len)
 {
-	struct crq_server_adapter *adapter =
-		(struct crq_server_adapter *)dev_instance;
+	u64 start;
+	u32 off, first;
 
-	vio_disable_interrupts(to_vio_dev(adapter->dev));
-	tasklet_schedule(&adapter->work_task);
+	len = min_t(u64, len, min_t(u64, vterm->history_head,
+				    vterm->history_size));
+	if (!len)
+		return 0;
 
-	return IRQ_HANDLED;
+	start = vterm->history_head - len;
+	off = start & (vterm->history_size - 1);
+	first = min(len, vterm->history_size - off);
+	memcpy(buf, vterm->history + off, first);
+	memcpy(buf + first, vterm->history, len - first);
+
+	return len;
 }
 
 /**
- * ibmvsm_reset_crq_queue - Reset CRQ Queue
+ * ibmvsm_obs_update_hold - Recompute how far receive may run ahead
  *
+ * @vterm:	ibmvsm_vterm struct
+ *
+ * Records the cursor of the VSM_OBSERVE_BLOCK observer furthest behind.
+ * Must be called with vterm->lock held after a blocking observer comes,
+ * goes or reads.
+ */
+static void ibmvsm_obs_update_hold(struct ibmvsm_vterm *vterm)
+{
+	u32 head = READ_ONCE(vterm->rx_head);
+	struct ibmvsm_observer *obs;
+	u32 lag, max_lag = 0;
+	u32 blockers = 0;
+
+	/* Receive may be adding data meanwhile, go by one head throughout */
+	list_for_each_entry(obs, &vterm->observers, node) {
+		if (!obs->block)
+			continue;
+		lag = head - obs->cursor;
+		if (lag > max_lag)
+			max_lag = lag;
+		blockers++;
+	}
+
+	vterm->rx_hold = head - max_lag;
+	WRITE_ONCE(vterm->rx_blockers, blockers);
+}
+
+/*
+ * Producer side: room in the receive ring, which must neither overwrite
+ * what the session has not read nor what a blocking observer has not.
+ */
+static u32 ibmvsm_rx_space(struct ibmvsm_vterm *vterm)
+{
+	u32 head = READ_ONCE(vterm->rx_head);
+	u32 space = ibmvsm_ring_space(&vterm->rx, head);
+	u32 lag;
+
+	if (!READ_ONCE(vterm->rx_blockers))
+		return space;
+
+	lag = head - READ_ONCE(vterm->rx_hold);
+	return min(space, vterm->rx.size - min(lag, vterm->rx.size));
+}
+
+/*
+ * Producer side: check the receive ring has room for another hcall. If
+ * not, VSM_RING_NEED_KICK is raised and the vterm is left pending until
+ * ibmvsm_rx_kick() sees the consumer make room.
+ */
+static bool ibmvsm_rx_room(struct ibmvsm_vterm *vterm, u32 max)
+{
+	unsigned long *pending = vterm->adapter->rx_pending;
+
+	if (ibmvsm_rx_space(vterm) >= max)
+		return true;
+
+	WRITE_ONCE(vterm->rx.ctrl->flags, VSM_RING_NEED_KICK);
+	set_bit(vterm->index, pending);
+	/* Pairs with the barrier in ibmvsm_rx_kick() */
+	smp_mb__after_atomic();
+	if (ibmvsm_rx_space(vterm) < max) {
+		ibmvsm_stat_add(vterm, IBMVSM_STAT_RX_RING_FULL, 1);
+		return false;
+	}
+	clear_bit(vterm->index, pending);
+	WRITE_ONCE(vterm->rx.ctrl->flags, 0);
+
+	return true;
+}
+
+/**
+ * ibmvsm_vterm_rx_batch - Drain a batch of receive data into the ring
+ *
+ * @vterm:	ibmvsm_vterm struct, ready and attached
+ * @buf:	bounce buffer of IBMVSM_MAX_CHARS bytes
+ * @max:	negotiated bytes per hcall
+ *
+ * Makes up to IBMVSM_RX_BATCH hcalls without vterm->lock; the caller's
+ * RCU read side section keeps the rings from being freed. The lock is
+ * only taken afterwards, to copy the batch into the history.
+ *
+ * Readers and pollers are woken only when the ring goes from empty to
+ * non-empty, not once per chunk. Observers are woken once per batch that
+ * added data, since each follows its own cursor.
+ *
+ * Return:
+ *	true if firmware may have more data and the ring has room for it
+ */
+static bool ibmvsm_vterm_rx_batch(struct ibmvsm_vterm *vterm, char *buf,
+				  u32 max)
+{
+	u32 start = vterm->rx_head;
+	u32 produced = 0, head;
+	bool wake, obs_wake;
+	unsigned int i;
+	long len;
+
+	WRITE_ONCE(vterm->rx.ctrl->flags, 0);
+	for (i = 0; i < IBMVSM_RX_BATCH; i++) {
+		if (!ibmvsm_rx_room(vterm, max))
+			break;
+
+		len = ibmvsm_get_chars(vterm, buf, max);
+		if (len <= 0)
+			break;
+
+		head = ibmvsm_ring_put(&vterm->rx, vterm->rx_head, buf, len);
+		/* Observers never look past this, see ibmvsm_obs_lost() */
+		smp_store_release(&vterm->rx_head, head);
+		ibmvsm_stat_add(vterm, IBMVSM_STAT_RX_BYTES, len);
+		produced += len;
+	}
+
+	if (!produced)
+		return false;
+
+	wake = ibmvsm_ring_filled(&vterm->rx, start, vterm->rx_head);
+
+	spin_lock_bh(&vterm->lock);
+	ibmvsm_history_put_ring(vterm, start, produced);
+	obs_wake = !list_empty(&vterm->observers);
+	spin_unlock_bh(&vterm->lock);
+
+	if (wake)
+		wake_up_interruptible_poll(&vterm->rx_wait,
+					   EPOLLIN | EPOLLRDNORM);
+	if (obs_wake)
+		wake_up_interruptible_poll(&vterm->obs_wait,
+					   EPOLLIN | EPOLLRDNORM);
+
+	return i == IBMVSM_RX_BATCH;
+}
+
+/**
+ * ibmvsm_vterm_rx_detached - Drain a batch of receive data, no session
+ *
+ * @vterm:	ibmvsm_vterm struct, ready and detached
+ * @buf:	bounce buffer of IBMVSM_MAX_CHARS bytes
+ * @max:	negotiated bytes per hcall
+ * @total:	bytes taken so far this pass
+ *
+ * With no session there is no receive ring, so data only goes to the
+ * history, under vterm->lock per chunk. At most IBMVSM_RX_RING_SIZE bytes
+ * are taken per pass; if there may be more the vterm stays pending for
+ * the next CRQ processing pass.
+ *
+ * Return:
+ *	true if firmware may have more data for this pass
+ */
+static bool ibmvsm_vterm_rx_detached(struct ibmvsm_vterm *vterm, char *buf,
+				     u32 max, u32 *total)
+{
+	struct crq_server_adapter *adapter = vterm->adapter;
+	unsigned int i;
+	long len;
+
+	for (i = 0; i < IBMVSM_RX_BATCH; i++) {
+		if (*total >= IBMVSM_RX_RING_SIZE) {
+			set_bit(vterm->index, adapter->rx_pending);
+			ibmvsm_schedule_crq(adapter);
+			return false;
+		}
+
+		len = ibmvsm_get_chars(vterm, buf, max);
+		if (len <= 0)
+			return false;
+
+		spin_lock_bh(&vterm->lock);
+		ibmvsm_history_put(vterm, buf, len);
+		spin_unlock_bh(&vterm->lock);
+		ibmvsm_stat_add(vterm, IBMVSM_STAT_RX_BYTES, len);
+		*total += len;
+	}
+
+	return true;
+}
+
+/**
+ * ibmvsm_vterm_rx - Drain receive data for a vterm
+ *
+ * @vterm:	ibmvsm_vterm struct
+ *
+ * Calls H_GET_TERM_CHAR_LP until firmware has no more data for the vterm
+ * or the receive ring is full. If the ring fills up, the vterm is marked
+ * pending, VSM_RING_NEED_KICK is raised for a consumer using the mapping,
+ * and draining resumes once the reader has made room. Only called from CRQ
+ * processing, which makes it the single producer of vterm->rx. Everything
+ * received is also appended to the vterm's history, if it keeps one.
+ *
+ * The hcalls are made in batches outside vterm->lock. Each batch runs in
+ * an RCU read side section after finding the vterm ready under the lock,
+ * which closing and detaching wait out before freeing the rings. In
+ * workqueue mode the CPU is offered up between batches.
+ */
+static void ibmvsm_vterm_rx(struct ibmvsm_vterm *vterm)
+{
+	char buf[IBMVSM_MAX_CHARS] __aligned(sizeof(unsigned long));
+	u32 max = READ_ONCE(vterm->adapter->max_chars);
+	bool ready, detached, more;
+	u32 total = 0;
+
+	clear_bit(vterm->index, vterm->adapter->rx_pending);
+	do {
+		rcu_read_lock();
+		spin_lock_bh(&vterm->lock);
+		ready = vterm->state == ibmvterm_state_ready;
+		detached = vterm->detached;
+		spin_unlock_bh(&vterm->lock);
+
+		if (!ready)
+			more = false;
+		else if (detached)
+			more = ibmvsm_vterm_rx_detached(vterm, buf, max,
+							&total);
+		else
+			more = ibmvsm_vterm_rx_batch(vterm, buf, max);
+		rcu_read_unlock();
+
+		if (more && crq_mode == ibmvsm_crq_workqueue)
+			cond_resched();
+	} while (more);
+}
+
+/**
+ * ibmvsm_rx_resume - Resume draining throttled vterms
+ *
+ * @adapter:	crq_server_adapter struct
+ *
+ * Called from CRQ processing to pick up receive data that was left in
+ * firmware while a vterm's receive ring was full.
+ */
+static void ibmvsm_rx_resume(struct crq_server_adapter *adapter)
+{
+	unsigned long i;
+
+	for_each_set_bit(i, adapter->rx_pending, adapter->nr_vterms)
+		ibmvsm_vterm_rx(adapter->vterms[i]);
+}
+
+/**
+ * ibmvsm_rx_kick - Resume receive throttled by a full ring
+ *
+ * @vterm:	ibmvsm_vterm struct
+ *
+ * Consumer side, called once room has been made in the receive ring,
+ * by the session or by a blocking observer.
+ */
+static void ibmvsm_rx_kick(struct ibmvsm_vterm *vterm)
+{
+	/* Pairs with the barrier in ibmvsm_rx_room() */
+	smp_mb();
+	if (test_bit(vterm->index, vterm->adapter->rx_pending) &&
+	    ibmvsm_rx_space(vterm) >= READ_ONCE(vterm->adapter->max_chars))
+		ibmvsm_schedule_crq(vterm->adapter);
+}
+
+/**
+ * ibmvsm_lock_io - Take a vterm's rx_lock or tx_lock for a read or write
+ *
+ * @iocb:	kiocb of the read or write
+ * @lock:	rx_lock or tx_lock
+ *
+ * An IOCB_NOWAIT caller, such as io_uring trying the request inline,
+ * must not sleep on another reader or writer either.
+ *
+ * Return:
+ *	0 - Success
+ *	-EAGAIN - IOCB_NOWAIT and the lock is busy
+ *	-ERESTARTSYS - Interrupted by a signal
+ */
+static int ibmvsm_lock_io(struct kiocb *iocb, struct mutex *lock)
+{
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return mutex_trylock(lock) ? 0 : -EAGAIN;
+
+	if (mutex_lock_interruptible(lock))
+		return -ERESTARTSYS;
+
+	return 0;
+}
+
+/* Fail with -EAGAIN instead of sleeping for data or ring space */
+static bool ibmvsm_io_nowait(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+	       (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+static ssize_t ibmvsm_mux_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t ibmvsm_mux_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static __poll_t ibmvsm_mux_poll(struct file *file, poll_table *wait);
+static ssize_t ibmvsm_obs_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static __poll_t ibmvsm_obs_poll(struct file *file, poll_table *wait);
+
+/**
+ * ibmvsm_read_iter - Read
+ *
+ * @iocb:	kiocb struct
+ * @to:		destination iov_iter
+ *
+ * Fills all segments of @to from the receive ring in one pass. Blocks
+ * until data arrives unless the file was opened with O_NONBLOCK or the
+ * request carries IOCB_NOWAIT, in which case -EAGAIN tells io_uring or an
+ * aio user to wait for EPOLLIN and retry.
+ *
+ * Return:
+ *	Number of bytes read - Success
+ *	Negative - Failure
+ */
+static ssize_t ibmvsm_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *file = iocb->ki_filp;
+	struct ibmvsm_file_session *session = file->private_data;
+	struct ibmvsm_vterm *vterm;
+	ssize_t rc;
+
+	pr_debug("ibmvsm: read: file = 0x%lx, nbytes = 0x%lx\n",
+		 (unsigned long)file, (unsigned long)iov_iter_count(to));
+
+	if (session && READ_ONCE(session->mux))
+		return ibmvsm_mux_read_iter(iocb, to);
+	if (session && READ_ONCE(session->observer))
+		return ibmvsm_obs_read_iter(iocb, to);
+
+	if (!session || !session->valid)
+		return -EIO;
+
+	if (!iov_iter_count(to))
+		return 0;
+
+	vterm = session->vterm;
+	rc = ibmvsm_lock_io(iocb, &vterm->rx_lock);
+	if (rc)
+		return rc;
+
+	for (;;) {
+		/* Checked under rx_lock, a closed vterm has no ring */
+		if (!ibmvsm_vterm_alive(vterm)) {
+			rc = -EIO;
+			goto out;
+		}
+
+		if (!ibmvsm_ring_empty(&vterm->rx))
+			break;
+
+		if (ibmvsm_io_nowait(iocb)) {
+			rc = -EAGAIN;
+			goto out;
+		}
+
+		rc = wait_event_interruptible(vterm->rx_wait,
+					      !ibmvsm_ring_empty(&vterm->rx) ||
+					      !ibmvsm_vterm_alive(vterm));
+		if (rc)
+			goto out;
+	}
+
+	rc = ibmvsm_ring_to_iter(&vterm->rx, to);
+	if (rc > 0)
+		ibmvsm_rx_kick(vterm);
+out:
+	mutex_unlock(&vterm->rx_lock);
+	return rc;
+}
+
+/* Backoff ceiling in jiffies, a ceiling of 0 must not turn it into a spin */
+static unsigned long ibmvsm_tx_backoff_max(void)
+{
+	return max(msecs_to_jiffies(READ_ONCE(tx_backoff_max_ms)), 1UL);
+}
+
+/* Consumer side: data queued past the transmit tail the kernel has reached */
+static bool ibmvsm_tx_pending(struct ibmvsm_vterm *vterm)
+{
+	return READ_ONCE(vterm->tx.ctrl->head) != READ_ONCE(vterm->tx_tail);
+}
+
+/**
+ * ibmvsm_tx_activate - Queue a vterm on the adapter transmit scheduler
+ *
+ * @vterm:	ibmvsm_vterm struct
+ *
+ * Called whenever the vterm's transmit ring may have gained data. A vterm
+ * in H_BUSY backoff is left alone; it rejoins when the backoff expires.
+ */
+static void ibmvsm_tx_activate(struct ibmvsm_vterm *vterm)
+{
+	struct crq_server_adapter *adapter = vterm->adapter;
+
+	if (delayed_work_pending(&vterm->tx_work) || vterm->detached)
+		return;
+
+	spin_lock_bh(&adapter->tx_sched_lock);
+	if (list_empty(&vterm->tx_node) && ibmvsm_vterm_alive(vterm)) {
+		vterm->tx_deficit = 0;
+		list_add_tail(&vterm->tx_node,
+			      &adapter->tx_active[vterm->tx_class]);
+	}
+	spin_unlock_bh(&adapter->tx_sched_lock);
+
+	schedule_work(&adapter->tx_work);
+}
+
+/* H_BUSY backoff expired, let the vterm compete for hcalls again */
+static void ibmvsm_tx_backoff_work(struct work_struct *work)
+{
+	struct ibmvsm_vterm *vterm =
+		container_of(to_delayed_work(work), struct ibmvsm_vterm,
+			     tx_work);
+
+	ibmvsm_tx_activate(vterm);
+}
+
+/**
+ * ibmvsm_tx_unschedule - Take a vterm off the transmit scheduler
+ *
+ * @vterm:	ibmvsm_vterm struct, no longer ready
+ *
+ * Waits for a scheduler pass that may be transmitting on the vterm.
+ */
+static void ibmvsm_tx_unschedule(struct ibmvsm_vterm *vterm)
+{
+	struct crq_server_adapter *adapter = vterm->adapter;
+
+	cancel_delayed_work_sync(&vterm->tx_work);
+	mutex_lock(&adapter->tx_mutex);
+	spin_lock_bh(&adapter->tx_sched_lock);
+	list_del_init(&vterm->tx_node);
+	spin_unlock_bh(&adapter->tx_sched_lock);
+	mutex_unlock(&adapter->tx_mutex);
+}
+
+enum ibmvsm_tx_result {
+	ibmvsm_tx_idle,		/* ring empty or vterm not ready */
+	ibmvsm_tx_more,		/* hcall allowance used up, data left */
+	ibmvsm_tx_busy,		/* firmware busy, backoff scheduled */
+};
+
+/**
+ * ibmvsm_vterm_tx - Transmit from one vterm
+ *
+ * @vterm:	ibmvsm_vterm struct
+ * @limit:	most put chars hcalls to make
+ * @used:	incremented by the put chars hcalls made
+ *
+ * Drains the vterm's transmit ring with H_PUT_TERM_CHAR_LP, always packing
+ * the negotiated max_chars bytes per hcall so only the tail of the queued
+ * data goes out as a short send. When firmware is busy the vterm is parked
+ * for an exponential backoff capped at tx_backoff_max_ms, while other
+ * vterms keep transmitting. Writers and pollers are woken only when the
+ * ring goes from full to non-full. Once the ring is empty
+ * VSM_RING_NEED_KICK tells a producer using the mapping to kick it.
+ *
+ * Must be called with adapter->tx_mutex held, which makes the caller the
+ * single consumer of vterm->tx.
+ */
+static enum ibmvsm_tx_result ibmvsm_vterm_tx(struct ibmvsm_vterm *vterm,
+					     unsigned int limit,
+					     unsigned int *used)
+{
+	char buf[IBMVSM_MAX_CHARS] __aligned(sizeof(unsigned long));
+	enum ibmvsm_tx_result res = ibmvsm_tx_idle;
+	unsigned int n = 0;
+	u32 start;
+	long rc;
+	u32 len;
+
+	/* A detached vterm has no transmit ring */
+	if (vterm->detached)
+		return ibmvsm_tx_idle;
+
+	start = vterm->tx_tail;
+	WRITE_ONCE(vterm->tx.ctrl->flags, 0);
+	while (vterm->state == ibmvterm_state_ready) {
+		len = ibmvsm_ring_peek(&vterm->tx, vterm->tx_tail, buf,
+				       READ_ONCE(vterm->adapter->max_chars));
+		if (!len) {
+			WRITE_ONCE(vterm->tx.ctrl->flags, VSM_RING_NEED_KICK);
+			/* Recheck for a producer that saw the flag clear */
+			smp_mb();
+			if (!ibmvsm_tx_pending(vterm))
+				break;
+			WRITE_ONCE(vterm->tx.ctrl->flags, 0);
+			continue;
+		}
+
+		if (n == limit) {
+			res = ibmvsm_tx_more;
+			break;
+		}
+
+		rc = ibmvsm_put_chars(vterm, buf, len);
+		n++;
+		if (rc == -EAGAIN) {
+			ibmvsm_stat_add(vterm, IBMVSM_STAT_PUT_CHARS_BUSY, 1);
+			vterm->tx_busy++;
+			vterm->tx_backoff = clamp_t(unsigned long,
+						    vterm->tx_backoff * 2, 1,
+						    ibmvsm_tx_backoff_max());
+			schedule_delayed_work(&vterm->tx_work, vterm->tx_backoff);
+			res = ibmvsm_tx_busy;
+			break;
+		}
+
+		if (rc < 0) {
+			/* Keep the data for the vterm a CRQ reset reopens */
+			if (READ_ONCE(vterm->adapter->resetting))
+				break;
+
+			len = ibmvsm_ring_avail(&vterm->tx, vterm->tx_tail);
+			dev_err_ratelimited(vterm->adapter->dev,
+					    "put chars to vterm 0x%llx failed, dropping %u bytes\n",
+					    vterm->console_token, len);
+			WRITE_ONCE(vterm->tx_tail,
+				   ibmvsm_ring_consume(&vterm->tx,
+						       vterm->tx_tail, len));
+			continue;
+		}
+
+		WRITE_ONCE(vterm->tx_tail,
+			   ibmvsm_ring_consume(&vterm->tx, vterm->tx_tail, rc));
+		ibmvsm_stat_add(vterm, IBMVSM_STAT_TX_BYTES, rc);
+		vterm->tx_backoff = 0;
+	}
+
+	if (vterm->tx_tail != start &&
+	    ibmvsm_ring_drained(&vterm->tx, start, vterm->tx_tail))
+		wake_up_interruptible_poll(&vterm->tx_wait,
+					   EPOLLOUT | EPOLLWRNORM);
+
+	*used += n;
+	return res;
+}
+
+/**
+ * ibmvsm_tx_flush - Transmit what a vterm has queued, ahead of its turn
+ *
+ * @vterm:	ibmvsm_vterm struct
+ *
+ * Used on close. Stops at the first H_BUSY rather than waiting it out.
+ */
+static void ibmvsm_tx_flush(struct ibmvsm_vterm *vterm)
+{
+	struct crq_server_adapter *adapter = vterm->adapter;
+	unsigned int used = 0;
+
+	cancel_delayed_work_sync(&vterm->tx_work);
+	mutex_lock(&adapter->tx_mutex);
+	ibmvsm_vterm_tx(vterm, UINT_MAX, &used);
+	mutex_unlock(&adapter->tx_mutex);
+}
+
+/**
+ * ibmvsm_tx_sched_work - Adapter transmit scheduler
+ *
+ * @work:	tx_work embedded in the crq_server_adapter
+ *
+ * Shares the adapter's put chars hcalls between vterms with deficit round
+ * robin. Each turn a vterm is credited tx_quantum hcalls times its weight
+ * and transmits until the credit, its data or firmware patience runs out;
+ * a vterm that still has data goes to the back of the line keeping what
+ * is left of its credit. Vterms in the low latency class are served
+ * before any bulk vterm gets a turn, so a keystroke waits for at most one
+ * bulk turn. After tx_budget hcalls the work requeues itself.
+ */
+static void ibmvsm_tx_sched_work(struct work_struct *work)
+{
+	struct crq_server_adapter *adapter =
+		container_of(work, struct crq_server_adapter, tx_work);
+	unsigned int budget = max(READ_ONCE(tx_budget), 1U);
+	unsigned int quantum = max(READ_ONCE(tx_quantum), 1U);
+	enum ibmvsm_tx_result res;
+	struct ibmvsm_vterm *vterm;
+	unsigned int used = 0, before;
+	bool more = false;
+	int i;
+
+	mutex_lock(&adapter->tx_mutex);
+	for (;;) {
+		spin_lock_bh(&adapter->tx_sched_lock);
+		vterm = NULL;
+		for (i = 0; i < IBMVSM_TX_CLASSES; i++) {
+			vterm = list_first_entry_or_null(&adapter->tx_active[i],
+							 struct ibmvsm_vterm,
+							 tx_node);
+			if (vterm)
+				break;
+		}
+		if (vterm && used >= budget)
+			more = true;
+		if (!vterm || more) {
+			spin_unlock_bh(&adapter->tx_sched_lock);
+			break;
+		}
+		list_del_init(&vterm->tx_node);
+		spin_unlock_bh(&adapter->tx_sched_lock);
+
+		vterm->tx_deficit += quantum * vterm->tx_weight;
+		before = used;
+		res = ibmvsm_vterm_tx(vterm, vterm->tx_deficit, &used);
+		vterm->tx_deficit -= used - before;
+
+		spin_lock_bh(&adapter->tx_sched_lock);
+		/* A vterm closed meanwhile is no longer ready */
+		if (res == ibmvsm_tx_more &&
+		    vterm->state == ibmvterm_state_ready)
+			list_add_tail(&vterm->tx_node,
+				      &adapter->tx_active[vterm->tx_class]);
+		else
+			vterm->tx_deficit = 0;
+		spin_unlock_bh(&adapter->tx_sched_lock);
+	}
+	mutex_unlock(&adapter->tx_mutex);
+
+	if (more)
+		schedule_work(&adapter->tx_work);
+}
+
+/**
+ * ibmvsm_write_iter - Write
+ *
+ * @iocb:	kiocb struct
+ * @from:	source iov_iter
+ *
+ * Queues all segments of @from on the vterm's transmit ring and kicks the
+ * transmit worker. Blocks while the ring is full unless the file was
+ * opened with O_NONBLOCK or the request carries IOCB_NOWAIT; then only
+ * what fits is queued, or -EAGAIN returned if nothing does.
+ *
+ * Return:
+ *	Number of bytes queued - Success
+ *	Negative - Failure
+ */
+static ssize_t ibmvsm_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct ibmvsm_file_session *session = file->private_data;
+	struct ibmvsm_vterm *vterm;
+	size_t queued = 0;
+	ssize_t rc = 0;
+
+	pr_debug("ibmvsm: write: file = 0x%lx, count = 0x%lx\n",
+		 (unsigned long)file, (unsigned long)iov_iter_count(from));
+
+	if (session && READ_ONCE(session->mux))
+		return ibmvsm_mux_write_iter(iocb, from);
+	if (session && READ_ONCE(session->observer))
+		return -EBADF;
+
+	if (!session || !session->valid)
+		return -EIO;
+
+	if (!iov_iter_count(from))
+		return 0;
+
+	vterm = session->vterm;
+	rc = ibmvsm_lock_io(iocb, &vterm->tx_lock);
+	if (rc)
+		return rc;
+
+	while (iov_iter_count(from)) {
+		if (!ibmvsm_vterm_alive(vterm)) {
+			rc = -EIO;
+			break;
+		}
+
+		if (ibmvsm_ring_full(&vterm->tx)) {
+			ibmvsm_stat_add(vterm, IBMVSM_STAT_TX_RING_FULL, 1);
+			if (ibmvsm_io_nowait(iocb)) {
+				rc = -EAGAIN;
+				break;
+			}
+
+			rc = wait_event_interruptible(vterm->tx_wait,
+						      !ibmvsm_ring_full(&vterm->tx) ||
+						      !ibmvsm_vterm_alive(vterm));
+			if (rc)
+				break;
+			continue;
+		}
+
+		rc = ibmvsm_ring_from_iter(&vterm->tx, from);
+		if (rc < 0)
+			break;
+
+		queued += rc;
+		ibmvsm_tx_activate(vterm);
+	}
+
+	mutex_unlock(&vterm->tx_lock);
+
+	return queued ? queued : rc;
+}
+
+/**
+ * ibmvsm_poll - Poll
+ *
+ * @file:	file struct
+ * @wait:	Poll Table
+ *
+ * Readable while the vterm's receive ring holds data, writable while its
+ * transmit ring has room. A vterm that is no longer open reports
+ * EPOLLERR | EPOLLHUP. Also resumes receive for a consumer that drained a
+ * full ring through the mapping. vterm->lock keeps the rings from being
+ * freed underneath.
+ *
+ * Return:
+ *	poll.h return values
+ */
+static __poll_t ibmvsm_poll(struct file *file, poll_table *wait)
+{
+	struct ibmvsm_file_session *session = file->private_data;
+	struct ibmvsm_vterm *vterm;
+	__poll_t mask = 0;
+
+	if (session && READ_ONCE(session->mux))
+		return ibmvsm_mux_poll(file, wait);
+	if (session && READ_ONCE(session->observer))
+		return ibmvsm_obs_poll(file, wait);
+
+	if (!session || !session->valid)
+		return 0;
+
+	vterm = session->vterm;
+	poll_wait(file, &vterm->rx_wait, wait);
+	poll_wait(file, &vterm->tx_wait, wait);
+
+	spin_lock_bh(&vterm->lock);
+	if (!ibmvsm_vterm_alive(vterm)) {
+		spin_unlock_bh(&vterm->lock);
+		return EPOLLERR | EPOLLHUP;
+	}
+
+	if (!ibmvsm_ring_empty(&vterm->rx))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	else
+		ibmvsm_rx_kick(vterm);
+
+	if (!ibmvsm_ring_full(&vterm->tx))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	spin_unlock_bh(&vterm->lock);
+
+	return mask;
+}
+
+/*
+ * Multiplexed sessions. A session switched to multiplex mode by
+ * VSM_IOCTL_MUX_OPEN owns any number of vterms. Each member hooks an entry
+ * into its vterm's rx_wait and tx_wait, so the wakeups a vterm does for a
+ * bound session put it on the session's ready list instead. read() only
+ * visits ready members.
+ */
+
+/* A member's receive ring went from empty to non-empty */
+static int ibmvsm_mux_rx_wake(wait_queue_entry_t *wq, unsigned int mode,
+			      int sync, void *key)
+{
+	struct ibmvsm_mux_member *member =
+		container_of(wq, struct ibmvsm_mux_member, rx_wq);
+	struct ibmvsm_mux *mux = member->mux;
+	unsigned long flags;
+
+	spin_lock_irqsave(&mux->lock, flags);
+	if (list_empty(&member->ready))
+		list_add_tail(&member->ready, &mux->ready);
+	spin_unlock_irqrestore(&mux->lock, flags);
+
+	wake_up_interruptible_poll(&mux->wait, EPOLLIN | EPOLLRDNORM);
+	return 0;
+}
+
+/* A member's transmit ring went from full to non-full */
+static int ibmvsm_mux_tx_wake(wait_queue_entry_t *wq, unsigned int mode,
+			      int sync, void *key)
+{
+	struct ibmvsm_mux_member *member =
+		container_of(wq, struct ibmvsm_mux_member, tx_wq);
+
+	wake_up_interruptible_poll(&member->mux->wait, EPOLLOUT | EPOLLWRNORM);
+	return 0;
+}
+
+/**
+ * ibmvsm_mux_unlink - Take a vterm out of its multiplexed session
+ *
+ * @vterm:	ibmvsm_vterm struct, a member
+ * @hup:	closed underneath the session, which then reads a record
+ *		with VSM_MUX_HUP for it
+ *
+ * No reader or writer of the session starts on the vterm afterwards. One
+ * that already has holds rx_lock or tx_lock, which the vterm's rings are
+ * freed under. The vterm no longer points at the session either, so the
+ * ibmvsm_vterm_release() that follows returns it to the pool even when
+ * the session is being freed. Must be called with adapter->vterm_mutex
+ * held.
+ */
+static void ibmvsm_mux_unlink(struct ibmvsm_vterm *vterm, bool hup)
+{
+	struct ibmvsm_mux_member *member = vterm->mux_member;
+	struct ibmvsm_mux *mux = member->mux;
+
+	/* Also waits out a wake callback running on another CPU */
+	remove_wait_queue(&vterm->rx_wait, &member->rx_wq);
+	remove_wait_queue(&vterm->tx_wait, &member->tx_wq);
+
+	spin_lock_irq(&mux->lock);
+	WRITE_ONCE(vterm->mux, NULL);
+	vterm->mux_member = NULL;
+	member->vterm = NULL;
+	vterm->file_session = NULL;
+	if (hup) {
+		member->hup = true;
+		if (list_empty(&member->ready))
+			list_add_tail(&member->ready, &mux->ready);
+	} else {
+		list_del_init(&member->ready);
+		list_del(&member->node);
+	}
+	spin_unlock_irq(&mux->lock);
+
+	if (hup)
+		wake_up_interruptible_poll(&mux->wait, EPOLLIN | EPOLLRDNORM);
+	else
+		kfree(member);
+}
+
+/**
+ * ibmvsm_mux_token - Check a vterm is still a member of a session
+ *
+ * @mux:	ibmvsm_mux struct
+ * @vterm:	ibmvsm_vterm struct, rx_lock or tx_lock held
+ *
+ * The vterm may have been closed, and even reopened for another session,
+ * since it was found on one of @mux's lists.
+ *
+ * Return:
+ *	The console token it is a member under, or 0 if it is not a member
+ */
+static u64 ibmvsm_mux_token(struct ibmvsm_mux *mux, struct ibmvsm_vterm *vterm)
+{
+	u64 token = 0;
+
+	spin_lock_irq(&mux->lock);
+	if (READ_ONCE(vterm->mux) == mux)
+		token = vterm->mux_member->token;
+	spin_unlock_irq(&mux->lock);
+
+	return token;
+}
+
+/* Put a member back on the ready list, unless it has left meanwhile */
+static void ibmvsm_mux_requeue(struct ibmvsm_mux *mux,
+			       struct ibmvsm_vterm *vterm)
+{
+	struct ibmvsm_mux_member *member;
+
+	spin_lock_irq(&mux->lock);
+	if (READ_ONCE(vterm->mux) == mux) {
+		member = vterm->mux_member;
+		if (list_empty(&member->ready))
+			list_add_tail(&member->ready, &mux->ready);
+	}
+	spin_unlock_irq(&mux->lock);
+}
+
+/**
+ * ibmvsm_mux_read_record - Read one record of a multiplexed session
+ *
+ * @mux:	ibmvsm_mux struct, rx_lock held
+ * @to:		destination iov_iter, with room for more than a header
+ *
+ * Takes the first member off the ready list. It yields a hangup record if
+ * it was closed underneath, otherwise as much of its receive ring as fits.
+ * A member with data left goes to the back of the ready list, so members
+ * take turns.
+ *
+ * Return:
+ *	Bytes read - Success
+ *	0 - The member had nothing to read after all
+ *	-EAGAIN - No member is ready
+ *	-EFAULT - Copying the record failed
+ */
+static ssize_t ibmvsm_mux_read_record(struct ibmvsm_mux *mux,
+				      struct iov_iter *to)
+{
+	struct ibmvsm_mux_member *member;
+	struct ibmvsm_mux_hdr hdr = { };
+	struct ibmvsm_vterm *vterm;
+	size_t room, copied;
+	ssize_t rc;
+
+	spin_lock_irq(&mux->lock);
+	member = list_first_entry_or_null(&mux->ready,
+					  struct ibmvsm_mux_member, ready);
+	if (!member) {
+		spin_unlock_irq(&mux->lock);
+		return -EAGAIN;
+	}
+
+	list_del_init(&member->ready);
+	vterm = member->vterm;
+	/* Once hung up, nobody else can reach it */
+	if (member->hup)
+		list_del(&member->node);
+	spin_unlock_irq(&mux->lock);
+
+	if (!vterm) {
+		hdr.console_token = member->token;
+		hdr.flags = VSM_MUX_HUP;
+		kfree(member);
+		if (copy_to_iter(&hdr, sizeof(hdr), to) != sizeof(hdr))
+			return -EFAULT;
+		return sizeof(hdr);
+	}
+
+	mutex_lock(&vterm->rx_lock);
+	rc = 0;
+	hdr.console_token = ibmvsm_mux_token(mux, vterm);
+	if (!hdr.console_token)
+		goto out;
+
+	room = iov_iter_count(to) - sizeof(hdr);
+	hdr.len = min_t(size_t, room, ibmvsm_ring_used(&vterm->rx));
+	if (!hdr.len)
+		goto out;
+
+	if (copy_to_iter(&hdr, sizeof(hdr), to) != sizeof(hdr)) {
+		rc = -EFAULT;
+		goto requeue;
+	}
+
+	iov_iter_truncate(to, hdr.len);
+	rc = ibmvsm_ring_to_iter(&vterm->rx, to);
+	copied = rc > 0 ? rc : 0;
+	iov_iter_reexpand(to, room - copied);
+	if (copied)
+		ibmvsm_rx_kick(vterm);
+
+	/* A record cut short cannot be told apart from the next one */
+	rc = copied == hdr.len ? sizeof(hdr) + hdr.len : -EFAULT;
+
+requeue:
+	/* Pairs with the barrier in ibmvsm_ring_filled(): either we see data
+	 * added after the ring looked drained, or the producer wakes us.
+	 */
+	smp_mb();
+	if (!ibmvsm_ring_empty(&vterm->rx))
+		ibmvsm_mux_requeue(mux, vterm);
+out:
+	mutex_unlock(&vterm->rx_lock);
+	return rc;
+}
+
+/**
+ * ibmvsm_mux_read_iter - Read records of a multiplexed session
+ *
+ * @iocb:	kiocb struct
+ * @to:		destination iov_iter
+ *
+ * Fills @to with whole records from as many ready members as fit. Blocks
+ * until one is ready unless the file was opened with O_NONBLOCK or the
+ * request carries IOCB_NOWAIT.
+ *
+ * Return:
+ *	Number of bytes read - Success
+ *	Negative - Failure
+ */
+static ssize_t ibmvsm_mux_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct ibmvsm_file_session *session = iocb->ki_filp->private_data;
+	struct ibmvsm_mux *mux = session->mux;
+	size_t copied = 0;
+	ssize_t rc;
+
+	/* Room for a header and at least one byte of payload */
+	if (iov_iter_count(to) <= sizeof(struct ibmvsm_mux_hdr))
+		return -EINVAL;
+
+	for (;;) {
+		rc = ibmvsm_lock_io(iocb, &mux->rx_lock);
+		if (rc)
+			return rc;
+
+		while (iov_iter_count(to) > sizeof(struct ibmvsm_mux_hdr)) {
+			rc = ibmvsm_mux_read_record(mux, to);
+			if (rc < 0)
+				break;
+			copied += rc;
+		}
+		mutex_unlock(&mux->rx_lock);
+
+		if (copied)
+			return copied;
+		if (rc != -EAGAIN || ibmvsm_io_nowait(iocb))
+			return rc;
+
+		rc = wait_event_interruptible(mux->wait,
+					      !list_empty_careful(&mux->ready));
+		if (rc)
+			return rc;
+	}
+}
+
+/* A writer waiting for transmit ring room can go on */
+static bool ibmvsm_mux_tx_wait_done(struct ibmvsm_vterm *vterm)
+{
+	return !ibmvsm_ring_full(&vterm->tx) || !ibmvsm_vterm_alive(vterm);
+}
+
+/**
+ * ibmvsm_mux_write_record - Queue the payload of one record
+ *
+ * @mux:	ibmvsm_mux struct, tx_lock held
+ * @iocb:	kiocb of the write
+ * @hdr:	record header, already taken from @from
+ * @from:	source iov_iter, at the payload
+ *
+ * Without waiting the payload goes in whole or not at all. A blocking
+ * write that has queued part of a payload waits for room for the rest
+ * and lets only a fatal signal stop it, so a record is never cut short.
+ *
+ * Return:
+ *	0 - Success
+ *	Negative - Failure, @from is back at the payload
+ */
+static ssize_t ibmvsm_mux_write_record(struct ibmvsm_mux *mux,
+				       struct kiocb *iocb,
+				       const struct ibmvsm_mux_hdr *hdr,
+				       struct iov_iter *from)
+{
+	struct ibmvsm_mux_member *member;
+	struct ibmvsm_vterm *vterm = NULL;
+	size_t left;
+	u32 queued = 0;
+	ssize_t rc;
+
+	spin_lock_irq(&mux->lock);
+	list_for_each_entry(member, &mux->members, node) {
+		if (member->token == hdr->console_token) {
+			vterm = member->vterm;
+			break;
+		}
+	}
+	spin_unlock_irq(&mux->lock);
+	if (!vterm)
+		return -ENOENT;
+
+	rc = ibmvsm_lock_io(iocb, &vterm->tx_lock);
+	if (rc)
+		return rc;
+
+	if (ibmvsm_mux_token(mux, vterm) != hdr->console_token) {
+		rc = -ENOENT;
+		goto out;
+	}
+
+	if (ibmvsm_io_nowait(iocb) && ibmvsm_vterm_alive(vterm) &&
+	    ibmvsm_ring_space(&vterm->tx,
+			      READ_ONCE(vterm->tx.ctrl->head)) < hdr->len) {
+		ibmvsm_stat_add(vterm, IBMVSM_STAT_TX_RING_FULL, 1);
+		rc = -EAGAIN;
+		goto out;
+	}
+
+	rc = 0;
+	while (queued < hdr->len) {
+		if (!ibmvsm_vterm_alive(vterm)) {
+			rc = -EIO;
+			break;
+		}
+
+		if (ibmvsm_ring_full(&vterm->tx)) {
+			ibmvsm_stat_add(vterm, IBMVSM_STAT_TX_RING_FULL, 1);
+			if (queued)
+				rc = wait_event_killable(vterm->tx_wait,
+						ibmvsm_mux_tx_wait_done(vterm));
+			else
+				rc = wait_event_interruptible(vterm->tx_wait,
+						ibmvsm_mux_tx_wait_done(vterm));
+			if (rc)
+				break;
+			continue;
+		}
+
+		left = iov_iter_count(from);
+		iov_iter_truncate(from, hdr->len - queued);
+		rc = ibmvsm_ring_from_iter(&vterm->tx, from);
+		iov_iter_reexpand(from, left - (rc > 0 ? rc : 0));
+		if (rc < 0)
+			break;
+
+		queued += rc;
+		rc = 0;
+		ibmvsm_tx_activate(vterm);
+	}
+
+	if (rc)
+		iov_iter_revert(from, queued);
+out:
+	mutex_unlock(&vterm->tx_lock);
+	return rc;
+}
+
+/**
+ * ibmvsm_mux_write_iter - Write records to a multiplexed session
+ *
+ * @iocb:	kiocb struct
+ * @from:	source iov_iter, whole records
+ *
+ * Each record's payload is queued on the transmit ring of the member with
+ * its console token. Stops at the first record that fails.
+ *
+ * Return:
+ *	Number of bytes of whole records taken - Success
+ *	Negative - Failure of the first record
+ */
+static ssize_t ibmvsm_mux_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct ibmvsm_file_session *session = iocb->ki_filp->private_data;
+	struct ibmvsm_mux *mux = session->mux;
+	struct ibmvsm_mux_hdr hdr;
+	size_t written = 0;
+	ssize_t rc;
+
+	rc = ibmvsm_lock_io(iocb, &mux->tx_lock);
+	if (rc)
+		return rc;
+
+	while (iov_iter_count(from)) {
+		if (iov_iter_count(from) < sizeof(hdr)) {
+			rc = -EINVAL;
+			break;
+		}
+
+		if (!copy_from_iter_full(&hdr, sizeof(hdr), from)) {
+			rc = -EFAULT;
+			break;
+		}
+
+		/* Flags are only set on read */
+		if (hdr.flags || hdr.len > IBMVSM_TX_RING_SIZE ||
+		    hdr.len > iov_iter_count(from))
+			rc = -EINVAL;
+		else
+			rc = ibmvsm_mux_write_record(mux, iocb, &hdr, from);
+		if (rc) {
+			iov_iter_revert(from, sizeof(hdr));
+			break;
+		}
+
+		written += sizeof(hdr) + hdr.len;
+	}
+	mutex_unlock(&mux->tx_lock);
+
+	return written ? written : rc;
+}
+
+/**
+ * ibmvsm_mux_poll - Poll a multiplexed session
+ *
+ * @file:	file struct
+ * @wait:	Poll Table
+ *
+ * Readable while any member is ready, writable while no member's transmit
+ * ring is full.
+ *
+ * Return:
+ *	poll.h return values
+ */
+static __poll_t ibmvsm_mux_poll(struct file *file, poll_table *wait)
+{
+	struct ibmvsm_file_session *session = file->private_data;
+	struct ibmvsm_mux *mux = session->mux;
+	struct ibmvsm_mux_member *member;
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+	poll_wait(file, &mux->wait, wait);
+
+	spin_lock_irq(&mux->lock);
+	if (!list_empty(&mux->ready))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	/* Rings are only freed after the vterm is unlinked */
+	list_for_each_entry(member, &mux->members, node) {
+		if (member->vterm && ibmvsm_ring_full(&member->vterm->tx)) {
+			mask &= ~(EPOLLOUT | EPOLLWRNORM);
+			break;
+		}
+	}
+	spin_unlock_irq(&mux->lock);
+
+	return mask;
+}
+
+/**
+ * ibmvsm_obs_hangup - Cut the observers of a vterm off
+ *
+ * @vterm:	ibmvsm_vterm struct
+ *
+ * Called before the vterm's rings are freed. Observers read end of file
+ * from then on and no longer hold receive back. Must be called with
+ * adapter->vterm_mutex held.
+ */
+static void ibmvsm_obs_hangup(struct ibmvsm_vterm *vterm)
+{
+	struct ibmvsm_observer *obs, *tmp;
+
+	spin_lock_bh(&vterm->lock);
+	list_for_each_entry_safe(obs, tmp, &vterm->observers, node) {
+		list_del_init(&obs->node);
+		WRITE_ONCE(obs->hup, true);
+	}
+	WRITE_ONCE(vterm->rx_blockers, 0);
+	spin_unlock_bh(&vterm->lock);
+
+	wake_up_interruptible_all(&vterm->obs_wait);
+}
+
+/*
+ * Bytes at @cursor that a drop-oldest observer has lost to the producer,
+ * which may already be writing up to IBMVSM_MAX_CHARS past @head. Blocking
+ * observers hold the producer back instead and never lose any.
+ */
+static u32 ibmvsm_obs_lost(struct ibmvsm_observer *obs, u32 head, u32 cursor)
+{
+	u32 window = obs->vterm->rx.size - IBMVSM_MAX_CHARS;
+
+	if (obs->block || head - cursor <= window)
+		return 0;
+
+	return head - cursor - window;
+}
+
+/**
+ * ibmvsm_obs_advance - Move an observer's cursor past what it consumed
+ *
+ * @obs:	ibmvsm_observer struct
+ * @cursor:	new cursor
+ * @lost:	bytes skipped because the producer overwrote them
+ */
+static void ibmvsm_obs_advance(struct ibmvsm_observer *obs, u32 cursor,
+			       u32 lost)
+{
+	struct ibmvsm_vterm *vterm = obs->vterm;
+
+	spin_lock_bh(&vterm->lock);
+	obs->cursor = cursor;
+	if (obs->block)
+		ibmvsm_obs_update_hold(vterm);
+	spin_unlock_bh(&vterm->lock);
+
+	if (lost)
+		ibmvsm_stat_add(vterm, IBMVSM_STAT_RX_OBS_DROPPED, lost);
+	if (obs->block)
+		ibmvsm_rx_kick(vterm);
+}
+
+/**
+ * ibmvsm_obs_copy - Copy receive data to an observer
+ *
+ * @obs:	ibmvsm_observer struct
+ * @to:		destination iov_iter
+ *
+ * The producer does not wait for a drop-oldest observer, so what was
+ * copied is checked against the producer afterwards and copied again from
+ * further on if it was overwritten meanwhile. Must be called with
+ * vterm->obs_lock held.
+ *
+ * Return:
+ *	Number of bytes copied - Success
+ *	0 - The vterm's rings are gone
+ *	-EAGAIN - Nothing new to read
+ *	-EFAULT - Nothing could be copied
+ */
+static ssize_t ibmvsm_obs_copy(struct ibmvsm_observer *obs,
+			       struct iov_iter *to)
+{
+	struct ibmvsm_vterm *vterm = obs->vterm;
+	struct ibmvsm_ring *ring = &vterm->rx;
+	u32 head, cursor, lost, off, len, first;
+	size_t copied;
+
+	if (READ_ONCE(obs->hup))
+		return 0;
+
+	for (;;) {
+		head = smp_load_acquire(&vterm->rx_head);
+		lost = ibmvsm_obs_lost(obs, head, obs->cursor);
+		cursor = obs->cursor + lost;
+		len = min_t(size_t, head - cursor, iov_iter_count(to));
+		if (!len)
+			return -EAGAIN;
+
+		off = cursor & (ring->size - 1);
+		first = min(len, ring->size - off);
+		copied = copy_to_iter(ring->buf + off, first, to);
+		if (copied == first)
+			copied += copy_to_iter(ring->buf, len - first, to);
+
+		/* Pairs with the release in ibmvsm_vterm_rx_batch() */
+		smp_rmb();
+		if (!ibmvsm_obs_lost(obs, READ_ONCE(vterm->rx_head), cursor))
+			break;
+		iov_iter_revert(to, copied);
+	}
+
+	if (!copied)
+		return -EFAULT;
+
+	ibmvsm_obs_advance(obs, cursor + copied, lost);
+	return copied;
+}
+
+static bool ibmvsm_obs_readable(struct ibmvsm_observer *obs)
+{
+	return READ_ONCE(obs->hup) ||
+	       READ_ONCE(obs->vterm->rx_head) != READ_ONCE(obs->cursor);
+}
+
+/**
+ * ibmvsm_obs_read_iter - Read in observer mode
+ *
+ * @iocb:	kiocb struct
+ * @to:		destination iov_iter
+ *
+ * Reads what arrived on the followed vterm from the observer's own
+ * cursor, without consuming it for the session or other observers.
+ * Returns end of file once the vterm is closed or detached.
+ *
+ * Return:
+ *	Number of bytes read - Success
+ *	Negative - Failure
+ */
+static ssize_t ibmvsm_obs_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct ibmvsm_file_session *session = iocb->ki_filp->private_data;
+	struct ibmvsm_observer *obs = session->observer;
+	struct ibmvsm_vterm *vterm = obs->vterm;
+	ssize_t rc;
+
+	if (!iov_iter_count(to))
+		return 0;
+
+	for (;;) {
+		rc = ibmvsm_lock_io(iocb, &vterm->obs_lock);
+		if (rc)
+			return rc;
+		rc = ibmvsm_obs_copy(obs, to);
+		mutex_unlock(&vterm->obs_lock);
+
+		if (rc != -EAGAIN || ibmvsm_io_nowait(iocb))
+			return rc;
+
+		rc = wait_event_interruptible(vterm->obs_wait,
+					      ibmvsm_obs_readable(obs));
+		if (rc)
+			return rc;
+	}
+}
+
+/**
+ * ibmvsm_obs_poll - Poll in observer mode
+ *
+ * @file:	file struct
+ * @wait:	poll_table struct
+ *
+ * Return:
+ *	poll.h return values
+ */
+static __poll_t ibmvsm_obs_poll(struct file *file, poll_table *wait)
+{
+	struct ibmvsm_file_session *session = file->private_data;
+	struct ibmvsm_observer *obs = session->observer;
+
+	poll_wait(file, &obs->vterm->obs_wait, wait);
+
+	if (READ_ONCE(obs->hup))
+		return EPOLLIN | EPOLLRDNORM | EPOLLHUP;
+	if (ibmvsm_obs_readable(obs))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+/**
+ * ibmvsm_vterm_set_state - Change the state of a vterm
+ *
+ * @vterm:	ibmvsm_vterm struct
+ * @state:	new ibmvterm_state
+ */
+static void ibmvsm_vterm_set_state(struct ibmvsm_vterm *vterm, u32 state)
+{
+	trace_vterm_state(vterm, state);
+	vterm->state = state;
+}
+
+/**
+ * ibmvsm_get_free_vterm - Reserve a free vterm
+ *
+ * @adapter:	crq_server_adapter struct
+ *
+ * Must be called with adapter->vterm_mutex held. At most max_open vterms,
+ * as agreed with the partner, are handed out.
+ *
+ * Return:
+ *	Pointer to the reserved vterm, or NULL if all are in use
+ */
+static struct ibmvsm_vterm *
+ibmvsm_get_free_vterm(struct crq_server_adapter *adapter)
+{
+	struct ibmvsm_vterm *vterm;
+
+	if (adapter->nr_open >= READ_ONCE(adapter->max_open))
+		return NULL;
+
+	vterm = list_first_entry_or_null(&adapter->free_vterms,
+					 struct ibmvsm_vterm, free_list);
+	if (!vterm)
+		return NULL;
+
+	list_del_init(&vterm->free_list);
+	adapter->nr_open++;
+	ibmvsm_vterm_set_state(vterm, ibmvterm_state_initial);
+
+	return vterm;
+}
+
+/**
+ * ibmvsm_find_vterm - Find an open vterm by console token
+ *
+ * @adapter:		crq_server_adapter struct
+ * @console_token:	console token from the CRQ message
+ *
+ * Looks the token up in the adapter's vterm hash. Must be called within
+ * an RCU read side critical section.
+ *
+ * Return:
+ *	Pointer to the vterm, or NULL if no vterm uses the token
+ */
+static struct ibmvsm_vterm *
+ibmvsm_find_vterm(struct crq_server_adapter *adapter, u64 console_token)
+{
+	struct ibmvsm_vterm *vterm;
+
+	hash_for_each_possible_rcu(adapter->vterm_hash, vterm, hash_node,
+				   console_token)
+		if (vterm->console_token == console_token)
+			return vterm;
+
+	return NULL;
+}
+
+/**
+ * ibmvsm_find_open - Find an open vterm by the token it was opened with
+ *
+ * @adapter:	crq_server_adapter struct
+ * @token:	console token the vterm was given when opened
+ *
+ * Unlike the current console token, which a CRQ reset may change, this is
+ * what the ioctls hand out and take back. Must be called with
+ * adapter->vterm_mutex held.
+ *
+ * Return:
+ *	Pointer to the vterm, or NULL if no open vterm has the token
+ */
+static struct ibmvsm_vterm *
+ibmvsm_find_open(struct crq_server_adapter *adapter, u64 token)
+{
+	struct ibmvsm_vterm *vterm;
+
+	hash_for_each_possible(adapter->open_hash, vterm, open_node, token)
+		if (vterm->open_token == token)
+			return vterm;
+
+	return NULL;
+}
+
+/**
+ * ibmvsm_vterm_alloc_rings - Allocate the rings a session uses
+ *
+ * @vterm:	ibmvsm_vterm struct
+ *
+ * Return:
+ *	0 - Success
+ *	Non-zero - Failure, nothing is left allocated
+ */
+static int ibmvsm_vterm_alloc_rings(struct ibmvsm_vterm *vterm)
+{
+	int rc;
+
+	vterm->ctrl = vmalloc_user(sizeof(*vterm->ctrl));
+	if (!vterm->ctrl)
+		return -ENOMEM;
+
+	rc = ibmvsm_ring_alloc(&vterm->rx, &vterm->ctrl->rx,
+			       IBMVSM_RX_RING_SIZE);
+	if (!rc)
+		rc = ibmvsm_ring_alloc(&vterm->tx, &vterm->ctrl->tx,
+				       IBMVSM_TX_RING_SIZE);
+	if (rc) {
+		ibmvsm_ring_free(&vterm->rx);
+		vfree(vterm->ctrl);
+		vterm->ctrl = NULL;
+		return rc;
+	}
+
+	/* The transmit worker starts out idle */
+	vterm->ctrl->tx.flags = VSM_RING_NEED_KICK;
+	vterm->rx_head = 0;
+	vterm->tx_tail = 0;
+
+	return 0;
+}
+
+/* Free the rings once readers, observers and writers have let go */
+static void ibmvsm_vterm_free_rings(struct ibmvsm_vterm *vterm)
+{
+	ibmvsm_obs_hangup(vterm);
+	mutex_lock(&vterm->rx_lock);
+	mutex_lock(&vterm->obs_lock);
+	ibmvsm_ring_free(&vterm->rx);
+	mutex_unlock(&vterm->obs_lock);
+	mutex_unlock(&vterm->rx_lock);
+	mutex_lock(&vterm->tx_lock);
+	ibmvsm_ring_free(&vterm->tx);
+	mutex_unlock(&vterm->tx_lock);
+	vfree(vterm->ctrl);
+	vterm->ctrl = NULL;
+}
+
+/**
+ * ibmvsm_vterm_shutdown - First half of closing a vterm
+ *
+ * @vterm:	ibmvsm_vterm struct
+ *
+ * Stops all traffic on the vterm, wakes anybody still waiting on it and
+ * unhashes it. The caller must wait for an RCU grace period before
+ * ibmvsm_vterm_release(), which lets a batch of closes share one. Must be
+ * called with adapter->vterm_mutex held.
+ *
+ * Return:
+ *	true if the vterm was open with the hypervisor
+ */
+static bool ibmvsm_vterm_shutdown(struct ibmvsm_vterm *vterm)
+{
+	bool opened = ibmvsm_vterm_alive(vterm);
+
+	/* Closed underneath a multiplexed session, which reads a hangup */
+	if (vterm->mux_member)
+		ibmvsm_mux_unlink(vterm, true);
+
+	/* Give queued output one last chance to reach the partner */
+	if (opened)
+		ibmvsm_tx_flush(vterm);
+
+	/* Stop CRQ processing from draining into the ring */
+	spin_lock_bh(&vterm->lock);
+	ibmvsm_vterm_set_state(vterm, ibmvterm_state_initial);
+	spin_unlock_bh(&vterm->lock);
+	ibmvsm_tx_unschedule(vterm);
+	wake_up_interruptible_all(&vterm->rx_wait);
+	wake_up_interruptible_all(&vterm->tx_wait);
+
+	if (opened)
+		hash_del_rcu(&vterm->hash_node);
+
+	return opened;
+}
+
+/* Return a closed vterm to the free pool, under adapter->vterm_mutex */
+static void ibmvsm_vterm_put(struct ibmvsm_vterm *vterm)
+{
+	struct crq_server_adapter *adapter = vterm->adapter;
+
+	vterm->file_session = NULL;
+	vterm->orphaned = false;
+	vterm->owner = 0;
+	ibmvsm_vterm_set_state(vterm, ibmvterm_state_free);
+	list_add(&vterm->free_list, &adapter->free_vterms);
+	adapter->nr_open--;
+}
+
+/**
+ * ibmvsm_vterm_orphan - Take a vterm away from its file session
+ *
+ * @vterm:	ibmvsm_vterm struct, about to be closed
+ *
+ * The session fails with -EIO from now on but keeps the vterm, failed,
+ * until it is closed. A read or write already past its check of
+ * session->valid then cannot reach the vterm after it is reused. Only a
+ * session bound to the vterm is affected; a multiplexed session reads a
+ * hangup instead. Must be called with adapter->vterm_mutex held.
+ */
+static void ibmvsm_vterm_orphan(struct ibmvsm_vterm *vterm)
+{
+	struct ibmvsm_file_session *session = vterm->file_session;
+
+	if (session && session->vterm == vterm) {
+		session->valid = false;
+		vterm->orphaned = true;
+	}
+}
+
+/**
+ * ibmvsm_vterm_release - Second half of closing a vterm
+ *
+ * @vterm:	ibmvsm_vterm struct, shut down
+ * @opened:	what ibmvsm_vterm_shutdown() returned
+ *
+ * Closes the vterm with the hypervisor, frees its rings once readers and
+ * writers have let go and returns it to the free pool. A vterm taken away
+ * from its session by ibmvsm_vterm_orphan() is left failed instead, until
+ * ibmvsm_close() puts it back. Must be called with adapter->vterm_mutex
+ * held.
+ */
+static void ibmvsm_vterm_release(struct ibmvsm_vterm *vterm, bool opened)
+{
+	struct crq_server_adapter *adapter = vterm->adapter;
+	long rc;
+
+	if (opened) {
+		ibmvsm_adapter_stat_add(adapter, IBMVSM_STAT_CLOSE_VTERM, 1);
+		rc = h_close_vterm_lp(adapter, vterm->console_token);
+		if (rc != H_SUCCESS)
+			dev_warn(adapter->dev, "close vterm 0x%llx failed, rc %ld\n",
+				 vterm->console_token, rc);
+	}
+
+	ibmvsm_vterm_free_rings(vterm);
+	ibmvsm_history_free(vterm);
+	free_percpu(vterm->stats);
+	vterm->stats = NULL;
+
+	if (hash_hashed(&vterm->open_node))
+		hash_del(&vterm->open_node);
+	if (hash_hashed(&vterm->detached_node))
+		hash_del(&vterm->detached_node);
+	vterm->open_token = 0;
+	vterm->console_token = 0;
+	clear_bit(vterm->index, adapter->rx_pending);
+	vterm->tx_backoff = 0;
+	vterm->tx_busy = 0;
+	vterm->tx_weight = 1;
+	vterm->tx_class = IBMVSM_TX_BULK;
+	vterm->detached = false;
+	vterm->linger = false;
+
+	if (vterm->orphaned) {
+		ibmvsm_vterm_set_state(vterm, ibmvterm_state_failed);
+		return;
+	}
+
+	ibmvsm_vterm_put(vterm);
+}
+
+/**
+ * ibmvsm_vterm_close - Close a vterm and return it to the free pool
+ *
+ * @vterm:	ibmvsm_vterm struct
+ *
+ * Must be called with adapter->vterm_mutex held.
+ */
+static void ibmvsm_vterm_close(struct ibmvsm_vterm *vterm)
+{
+	bool opened = ibmvsm_vterm_shutdown(vterm);
+
+	/* The vterm may be reused under a new token */
+	if (opened)
+		synchronize_rcu();
+
+	ibmvsm_vterm_release(vterm, opened);
+}
+
+/* Key of a partner vterm in adapter->detached_hash */
+static u64 ibmvsm_detached_key(u32 session_id, u32 partition_id)
+{
+	return (u64)session_id << 32 | partition_id;
+}
+
+/**
+ * ibmvsm_find_detached - Find a detached vterm by partner ids
+ *
+ * @adapter:	crq_server_adapter struct, vterm_mutex held
+ * @id:		partner vterm
+ *
+ * Return:
+ *	Pointer to the vterm, or NULL if that partner vterm is not detached
+ */
+static struct ibmvsm_vterm *
+ibmvsm_find_detached(struct crq_server_adapter *adapter,
+		     const struct ibmvsm_setid *id)
+{
+	u64 key = ibmvsm_detached_key(id->session_id, id->partition_id);
+	struct ibmvsm_vterm *vterm;
+
+	hash_for_each_possible(adapter->detached_hash, vterm, detached_node,
+			       key)
+		if (vterm->session_id == id->session_id &&
+		    vterm->partition_id == id->partition_id)
+			return vterm;
+
+	return NULL;
+}
+
+/**
+ * ibmvsm_vterm_attach - Bind a session to a detached vterm
+ *
+ * @session:	ibmvsm_file_session struct
+ * @vterm:	ibmvsm_vterm struct, detached
+ *
+ * The vterm is still open with the hypervisor, so this makes no hcall.
+ * The session starts with empty rings; what arrived while detached is in
+ * the history. Must be called with adapter->vterm_mutex held.
+ *
+ * Return:
+ *	0 - Success
+ *	Non-zero - Failure, the vterm stays detached
+ */
+static long ibmvsm_vterm_attach(struct ibmvsm_file_session *session,
+				struct ibmvsm_vterm *vterm)
+{
+	struct crq_server_adapter *adapter = vterm->adapter;
+	int rc;
+
+	rc = ibmvsm_vterm_alloc_rings(vterm);
+	if (rc)
+		return rc;
+
+	vterm->file_session = session;
+	vterm->owner = session->id;
+	hash_del(&vterm->detached_node);
+	spin_lock_bh(&vterm->lock);
+	vterm->detached = false;
+	vterm->linger = false;
+	spin_unlock_bh(&vterm->lock);
+
+	set_bit(vterm->index, adapter->rx_pending);
+	ibmvsm_schedule_crq(adapter);
+
+	return 0;
+}
+
+/**
+ * ibmvsm_vterm_detach - Keep a vterm open after its session closes
+ *
+ * @vterm:	ibmvsm_vterm struct, alive
+ *
+ * Queued output gets one last chance to go out, then the rings are freed.
+ * Receive data keeps being drained into the history until a session binds
+ * to the same partner vterm again or the vterm is closed with
+ * VSM_IOCTL_CLOSE_BATCH. Must be called with adapter->vterm_mutex held.
+ */
+static void ibmvsm_vterm_detach(struct ibmvsm_vterm *vterm)
+{
+	struct crq_server_adapter *adapter = vterm->adapter;
+
+	ibmvsm_tx_flush(vterm);
+
+	/* Stop CRQ processing and transmit from using the rings */
+	spin_lock_bh(&vterm->lock);
+	vterm->detached = true;
+	spin_unlock_bh(&vterm->lock);
+	hash_add(adapter->detached_hash, &vterm->detached_node,
+		 ibmvsm_detached_key(vterm->session_id, vterm->partition_id));
+	ibmvsm_tx_unschedule(vterm);
+	vterm->tx_backoff = 0;
+	vterm->file_session = NULL;
+	/* Receive fills the ring outside vterm->lock, under RCU */
+	synchronize_rcu();
+	ibmvsm_vterm_free_rings(vterm);
+
+	set_bit(vterm->index, adapter->rx_pending);
+	ibmvsm_schedule_crq(adapter);
+}
+
+/**
+ * ibmvsm_vterm_bind - Open a partner vterm for a file session
+ *
+ * @session:	ibmvsm_file_session struct
+ * @id:		partner vterm to open
+ *
+ * Opens the vterm, or takes over a detached one, and points it at
+ * @session. Recording it in the session is left to the caller. Must be
+ * called with adapter->vterm_mutex held.
+ *
+ * Return:
+ *	The vterm - Success
+ *	ERR_PTR - Failure
+ */
+static struct ibmvsm_vterm *
+ibmvsm_vterm_bind(struct ibmvsm_file_session *session,
+		  const struct ibmvsm_setid *id)
+{
+	struct crq_server_adapter *adapter = session->adapter;
+	struct ibmvsm_vterm *vterm;
+	u64 token;
+	long rc;
+
+	if (adapter->state == ibmvsm_state_failed)
+		return ERR_PTR(-EIO);
+
+	/* The version exchange sets the limits vterms are opened with */
+	if (READ_ONCE(adapter->state) != ibmvsm_state_ready)
+		return ERR_PTR(-EAGAIN);
+
+	vterm = ibmvsm_find_detached(adapter, id);
+	if (vterm) {
+		rc = ibmvsm_vterm_attach(session, vterm);
+		return rc ? ERR_PTR(rc) : vterm;
+	}
+
+	/* Reserve HMC session */
+	vterm = ibmvsm_get_free_vterm(adapter);
+	if (!vterm)
+		return ERR_PTR(-EBUSY);
+
+	rc = ibmvsm_vterm_alloc_rings(vterm);
+	if (!rc)
+		rc = ibmvsm_history_alloc(vterm);
+	if (!rc) {
+		vterm->stats = alloc_percpu(struct ibmvsm_stats);
+		if (!vterm->stats)
+			rc = -ENOMEM;
+	}
+	if (rc) {
+		ibmvsm_vterm_close(vterm);
+		return ERR_PTR(rc);
+	}
+
+	/* Send H_OPEN_VTERM_LP */
+	ibmvsm_vterm_set_state(vterm, ibmvterm_state_opening);
+	ibmvsm_adapter_stat_add(adapter, IBMVSM_STAT_OPEN_VTERM, 1);
+	rc = h_open_vterm_lp(adapter, id->session_id, id->partition_id,
+			     &token);
+	if (rc != H_SUCCESS) {
+		dev_err(adapter->dev, "open vterm sid 0x%x pid 0x%x failed, rc %ld\n",
+			id->session_id, id->partition_id, rc);
+		ibmvsm_vterm_close(vterm);
+		return ERR_PTR(-EIO);
+	}
+
+	/* A token handed out before a CRQ reset may have come round again */
+	if (ibmvsm_find_open(adapter, token)) {
+		ibmvsm_adapter_stat_add(adapter, IBMVSM_STAT_CLOSE_VTERM, 1);
+		h_close_vterm_lp(adapter, token);
+		ibmvsm_vterm_close(vterm);
+		return ERR_PTR(-EEXIST);
+	}
+
+	vterm->console_token = token;
+	vterm->open_token = token;
+	hash_add(adapter->open_hash, &vterm->open_node, token);
+	vterm->session_id = id->session_id;
+	vterm->partition_id = id->partition_id;
+	vterm->file_session = session;
+	vterm->owner = session->id;
+	spin_lock_bh(&vterm->lock);
+	/* A CRQ reset that started meanwhile reopens it when done */
+	ibmvsm_vterm_set_state(vterm, READ_ONCE(adapter->resetting) ?
+				      ibmvterm_state_suspended :
+				      ibmvterm_state_ready);
+	spin_unlock_bh(&vterm->lock);
+	hash_add_rcu(adapter->vterm_hash, &vterm->hash_node,
+		     vterm->console_token);
+
+	/* Pick up anything the partner sent before the vterm was ready */
+	set_bit(vterm->index, adapter->rx_pending);
+	ibmvsm_schedule_crq(adapter);
+
+	return vterm;
+}
+
+/**
+ * ibmvsm_vterm_open - Open a partner vterm and bind it to a file session
+ *
+ * @session:	ibmvsm_file_session struct, not yet bound
+ * @id:		partner vterm to open
+ *
+ * Must be called with adapter->vterm_mutex held.
+ *
+ * Return:
+ *	0 - Success
+ *	Non-zero - Failure
+ */
+static long ibmvsm_vterm_open(struct ibmvsm_file_session *session,
+			      const struct ibmvsm_setid *id)
+{
+	struct ibmvsm_vterm *vterm;
+
+	if (session->valid || session->mux || session->observer)
+		return -EBUSY;
+
+	vterm = ibmvsm_vterm_bind(session, id);
+	if (IS_ERR(vterm))
+		return PTR_ERR(vterm);
+
+	session->vterm = vterm;
+	session->valid = true;
+
+	return 0;
+}
+
+/**
+ * ibmvsm_ioctl_setid - IOCTL set HMC ID
+ *
+ * @session: ibmvsm_file_session struct
+ * @new_hmc_id: struct ibmvsm_setid naming the partner vterm
+ *
+ * IOCTL command to open the partner vterm and bind it to this session.
+ *
+ * Return:
+ * 	0 - Success
+ * 	Non-zero - Failure
+ */
+static long ibmvsm_ioctl_setid(struct ibmvsm_file_session *session,
+			       struct ibmvsm_setid __user *new_hmc_id)
+{
+	struct crq_server_adapter *adapter = session->adapter;
+	struct ibmvsm_setid id;
+	long rc;
+
+	if (copy_from_user(&id, new_hmc_id, sizeof(id)))
+		return -EFAULT;
+
+	mutex_lock(&adapter->vterm_mutex);
+	rc = ibmvsm_vterm_open(session, &id);
+	mutex_unlock(&adapter->vterm_mutex);
+
+	return rc;
+}
+
+static const struct file_operations ibmvsm_fops;
+
+/**
+ * ibmvsm_open_one - Open a vterm on a new file session for a batch
+ *
+ * @opener:	ibmvsm_file_session struct making the batch, vterm_mutex held
+ * @entry:	batch entry, status and console_token are filled in
+ * @flags:	O_CLOEXEC and O_NONBLOCK for the new file
+ * @filp:	set to the new file, which the caller installs
+ *
+ * The new session shares @opener's id, so either may close the vterm with
+ * VSM_IOCTL_CLOSE_BATCH.
+ *
+ * Return:
+ *	fd reserved for @filp - Success
+ *	Negative - Failure, also stored in @entry
+ */
+static int ibmvsm_open_one(struct ibmvsm_file_session *opener,
+			   struct ibmvsm_open_entry *entry, u32 flags,
+			   struct file **filp)
+{
+	struct crq_server_adapter *adapter = opener->adapter;
+	struct ibmvsm_setid id = {
+		.session_id = entry->session_id,
+		.partition_id = entry->partition_id,
+	};
+	struct ibmvsm_file_session *session;
+	struct file *file;
+	int fd, rc;
+
+	fd = get_unused_fd_flags(flags & O_CLOEXEC);
+	if (fd < 0) {
+		rc = fd;
+		goto out;
+	}
+
+	session = kzalloc(sizeof(*session), GFP_KERNEL);
+	if (!session) {
+		rc = -ENOMEM;
+		goto put_fd;
+	}
+	session->adapter = adapter;
+	session->id = opener->id;
+
+	rc = ibmvsm_vterm_open(session, &id);
+	if (rc)
+		goto free_session;
+
+	file = anon_inode_getfile("[ibmvsm]", &ibmvsm_fops, session,
+				  O_RDWR | (flags & O_NONBLOCK));
+	if (IS_ERR(file)) {
+		rc = PTR_ERR(file);
+		ibmvsm_vterm_close(session->vterm);
+		goto free_session;
+	}
+
+	/* Dropped by ibmvsm_close() like for a session from ibmvsm_open() */
+	kref_get(&adapter->kref);
+	session->file = file;
+	file->f_mode |= FMODE_NOWAIT;
+	entry->console_token = session->vterm->open_token;
+	entry->status = 0;
+	*filp = file;
+
+	return fd;
+
+free_session:
+	kfree(session);
+put_fd:
+	put_unused_fd(fd);
+out:
+	entry->status = rc;
+	return rc;
+}
+
+/**
+ * ibmvsm_ioctl_open_batch - IOCTL open many vterms at once
+ *
+ * @session:	ibmvsm_file_session struct
+ * @ubatch:	struct ibmvsm_open_batch
+ *
+ * Opens a vterm for every entry, back to back under one vterm_mutex hold,
+ * each on a new file session that behaves like one bound with
+ * VSM_IOCTL_SETID. Every entry gets its own status; the new file
+ * descriptors only appear once the results have been copied out.
+ *
+ * Return:
+ *	Number of vterms opened - Success
+ *	Negative - Failure, nothing was opened
+ */
+static long ibmvsm_ioctl_open_batch(struct ibmvsm_file_session *session,
+				    struct ibmvsm_open_batch __user *ubatch)
+{
+	struct crq_server_adapter *adapter = session->adapter;
+	struct ibmvsm_open_entry __user *uentries;
+	struct ibmvsm_open_entry *entries;
+	struct ibmvsm_open_batch batch;
+	struct file **files;
+	long rc, opened = 0;
+	int fd;
+	u32 i;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+
+	if (!batch.count || batch.count > adapter->nr_vterms ||
+	    batch.flags & ~(O_CLOEXEC | O_NONBLOCK))
+		return -EINVAL;
+
+	uentries = u64_to_user_ptr(batch.entries);
+	entries = memdup_user(uentries, batch.count * sizeof(*entries));
+	if (IS_ERR(entries))
+		return PTR_ERR(entries);
+
+	files = kcalloc(batch.count, sizeof(*files), GFP_KERNEL);
+	if (!files) {
+		rc = -ENOMEM;
+		goto free_entries;
+	}
+
+	mutex_lock(&adapter->vterm_mutex);
+	for (i = 0; i < batch.count; i++) {
+		entries[i].console_token = 0;
+		fd = ibmvsm_open_one(session, &entries[i], batch.flags,
+				     &files[i]);
+		entries[i].fd = fd < 0 ? -1 : fd;
+		if (fd >= 0)
+			opened++;
+	}
+	mutex_unlock(&adapter->vterm_mutex);
+
+	if (copy_to_user(uentries, entries, batch.count * sizeof(*entries))) {
+		/* Closing the files closes their vterms */
+		for (i = 0; i < batch.count; i++) {
+			if (entries[i].fd < 0)
+				continue;
+			put_unused_fd(entries[i].fd);
+			fput(files[i]);
+		}
+		rc = -EFAULT;
+		goto free_files;
+	}
+
+	for (i = 0; i < batch.count; i++)
+		if (entries[i].fd >= 0)
+			fd_install(entries[i].fd, files[i]);
+	rc = opened;
+
+free_files:
+	kfree(files);
+free_entries:
+	kfree(entries);
+	return rc;
+}
+
+/**
+ * ibmvsm_ioctl_close_batch - IOCTL close many vterms at once
+ *
+ * @session:	ibmvsm_file_session struct
+ * @ubatch:	struct ibmvsm_close_batch
+ *
+ * Closes the vterm with each console token. Only vterms @session opened,
+ * itself or through VSM_IOCTL_OPEN_BATCH, and detached vterms, which no
+ * session owns, can be closed; others fail with -EPERM. A session bound
+ * to a vterm closed this way fails with -EIO like after a failed reset,
+ * and only has to be closed. Its vterm stays failed and bound to it until
+ * then, see ibmvsm_vterm_orphan(). The closes share one RCU grace period.
+ *
+ * Return:
+ *	Number of vterms closed - Success
+ *	Negative - Failure, nothing was closed
+ */
+static long ibmvsm_ioctl_close_batch(struct ibmvsm_file_session *session,
+				     struct ibmvsm_close_batch __user *ubatch)
+{
+	struct crq_server_adapter *adapter = session->adapter;
+	struct ibmvsm_close_entry __user *uentries;
+	struct ibmvsm_close_entry *entries;
+	struct ibmvsm_close_batch batch;
+	struct ibmvsm_vterm *vterm;
+	unsigned long *closing;
+	bool opened = false;
+	long rc = 0;
+	u32 i;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+
+	if (!batch.count || batch.count > adapter->nr_vterms || batch.flags)
+		return -EINVAL;
+
+	uentries = u64_to_user_ptr(batch.entries);
+	entries = memdup_user(uentries, batch.count * sizeof(*entries));
+	if (IS_ERR(entries))
+		return PTR_ERR(entries);
+
+	closing = kcalloc(BITS_TO_LONGS(adapter->nr_vterms),
+			  sizeof(unsigned long), GFP_KERNEL);
+	if (!closing) {
+		rc = -ENOMEM;
+		goto free_entries;
+	}
+
+	mutex_lock(&adapter->vterm_mutex);
+	for (i = 0; i < batch.count; i++) {
+		vterm = ibmvsm_find_open(adapter, entries[i].console_token);
+		/* Also catches a token listed twice */
+		if (!vterm || test_bit(vterm->index, closing)) {
+			entries[i].status = -ENOENT;
+			continue;
+		}
+
+		if (vterm->owner != session->id && !vterm->detached) {
+			entries[i].status = -EPERM;
+			continue;
+		}
+
+		ibmvsm_vterm_orphan(vterm);
+		opened |= ibmvsm_vterm_shutdown(vterm);
+		set_bit(vterm->index, closing);
+		entries[i].status = 0;
+		rc++;
+	}
+
+	/* Tokens may be reused once the vterms are back in the pool */
+	if (opened)
+		synchronize_rcu();
+
+	for_each_set_bit(i, closing, adapter->nr_vterms)
+		ibmvsm_vterm_release(adapter->vterms[i], true);
+	mutex_unlock(&adapter->vterm_mutex);
+
+	if (copy_to_user(uentries, entries, batch.count * sizeof(*entries)))
+		rc = -EFAULT;
+
+	kfree(closing);
+free_entries:
+	kfree(entries);
+	return rc;
+}
+
+/**
+ * ibmvsm_ioctl_kick - IOCTL kick the rings
+ *
+ * @session: ibmvsm_file_session struct
+ *
+ * Doorbell for sessions using the mapped rings: transmits data queued on
+ * the transmit ring and resumes receive throttled by a full receive ring.
+ * Only needed while the ring's VSM_RING_NEED_KICK flag is set.
+ *
+ * Return:
+ * 	0 - Success
+ * 	Non-zero - Failure
+ */
+static long ibmvsm_ioctl_kick(struct ibmvsm_file_session *session)
+{
+	struct ibmvsm_vterm *vterm;
+	long rc = 0;
+
+	if (!session->valid)
+		return -EIO;
+
+	vterm = session->vterm;
+	spin_lock_bh(&vterm->lock);
+	if (ibmvsm_vterm_alive(vterm)) {
+		ibmvsm_rx_kick(vterm);
+		if (ibmvsm_tx_pending(vterm))
+			ibmvsm_tx_activate(vterm);
+	} else {
+		rc = -EIO;
+	}
+	spin_unlock_bh(&vterm->lock);
+
+	return rc;
+}
+
+/**
+ * ibmvsm_ioctl_tx_prio - IOCTL set transmit weight and class
+ *
+ * @session:	ibmvsm_file_session struct
+ * @uprio:	struct ibmvsm_tx_prio
+ *
+ * A session with weight n gets n times the put chars hcalls of a weight 1
+ * session while both have data queued. VSM_TX_LOW_LATENCY puts it ahead
+ * of all other sessions, meant for interactive consoles.
+ *
+ * Return:
+ *	0 - Success
+ *	Non-zero - Failure
+ */
+static long ibmvsm_ioctl_tx_prio(struct ibmvsm_file_session *session,
+				 struct ibmvsm_tx_prio __user *uprio)
+{
+	struct crq_server_adapter *adapter = session->adapter;
+	struct ibmvsm_tx_prio prio;
+	struct ibmvsm_vterm *vterm;
+	long rc = 0;
+
+	if (copy_from_user(&prio, uprio, sizeof(prio)))
+		return -EFAULT;
+
+	if (!prio.weight || prio.weight > IBMVSM_TX_MAX_WEIGHT ||
+	    prio.flags & ~VSM_TX_LOW_LATENCY)
+		return -EINVAL;
+
+	mutex_lock(&adapter->vterm_mutex);
+	if (!session->valid) {
+		rc = -EIO;
+		goto out;
+	}
+
+	vterm = session->vterm;
+	spin_lock_bh(&adapter->tx_sched_lock);
+	vterm->tx_weight = prio.weight;
+	vterm->tx_class = prio.flags & VSM_TX_LOW_LATENCY ?
+			  IBMVSM_TX_LATENCY : IBMVSM_TX_BULK;
+	/* Waiting for a turn, so move it over now */
+	if (!list_empty(&vterm->tx_node))
+		list_move_tail(&vterm->tx_node,
+			       &adapter->tx_active[vterm->tx_class]);
+	spin_unlock_bh(&adapter->tx_sched_lock);
+out:
+	mutex_unlock(&adapter->vterm_mutex);
+	return rc;
+}
+
+/**
+ * ibmvsm_ioctl_get_history - IOCTL read the receive history
+ *
+ * @session:	ibmvsm_file_session struct
+ * @uhist:	struct ibmvsm_history
+ *
+ * Copies up to len of the most recently received bytes, oldest first,
+ * whether or not they have been read already. Leaves the receive ring
+ * alone.
+ *
+ * Return:
+ *	Number of bytes copied - Success
+ *	Negative - Failure
+ */
+static long ibmvsm_ioctl_get_history(struct ibmvsm_file_session *session,
+				     struct ibmvsm_history __user *uhist)
+{
+	struct crq_server_adapter *adapter = session->adapter;
+	struct ibmvsm_history hist;
+	struct ibmvsm_vterm *vterm;
+	char *kbuf = NULL;
+	long rc = 0;
+	u32 len;
+
+	if (copy_from_user(&hist, uhist, sizeof(hist)))
+		return -EFAULT;
+
+	if (hist.flags)
+		return -EINVAL;
+
+	mutex_lock(&adapter->vterm_mutex);
+	if (!session->valid) {
+		mutex_unlock(&adapter->vterm_mutex);
+		return -EIO;
+	}
+
+	vterm = session->vterm;
+	len = min(hist.len, vterm->history_size);
+	if (len) {
+		kbuf = vmalloc(len);
+		if (kbuf) {
+			spin_lock_bh(&vterm->lock);
+			rc = ibmvsm_history_get(vterm, kbuf, len);
+			spin_unlock_bh(&vterm->lock);
+		} else {
+			rc = -ENOMEM;
+		}
+	}
+	mutex_unlock(&adapter->vterm_mutex);
+
+	if (rc > 0 && copy_to_user(u64_to_user_ptr(hist.buf), kbuf, rc))
+		rc = -EFAULT;
+	vfree(kbuf);
+
+	return rc;
+}
+
+/**
+ * ibmvsm_ioctl_linger - IOCTL keep the vterm open after close
+ *
+ * @session:	ibmvsm_file_session struct
+ * @ulinger:	u32, non-zero to linger
+ *
+ * A lingering vterm stays open with the hypervisor when its session is
+ * closed, feeding its history, and the next VSM_IOCTL_SETID for the same
+ * partner vterm binds to it again without an H_OPEN_VTERM_LP.
+ *
+ * Return:
+ *	0 - Success
+ *	Non-zero - Failure
+ */
+static long ibmvsm_ioctl_linger(struct ibmvsm_file_session *session,
+				u32 __user *ulinger)
+{
+	struct crq_server_adapter *adapter = session->adapter;
+	long rc = 0;
+	u32 linger;
+
+	if (get_user(linger, ulinger))
+		return -EFAULT;
+
+	mutex_lock(&adapter->vterm_mutex);
+	if (session->valid)
+		session->vterm->linger = !!linger;
+	else
+		rc = -EIO;
+	mutex_unlock(&adapter->vterm_mutex);
+
+	return rc;
+}
+
+/**
+ * ibmvsm_mux_get - Switch a session to multiplex mode
+ *
+ * @session:	ibmvsm_file_session struct
+ *
+ * Must be called with adapter->vterm_mutex held.
+ *
+ * Return:
+ *	The session's ibmvsm_mux - Success
+ *	ERR_PTR - Failure, the session is bound or out of memory
+ */
+static struct ibmvsm_mux *ibmvsm_mux_get(struct ibmvsm_file_session *session)
+{
+	struct ibmvsm_mux *mux = session->mux;
+
+	if (mux)
+		return mux;
+
+	if (session->valid || session->observer)
+		return ERR_PTR(-EBUSY);
+
+	mux = kzalloc(sizeof(*mux), GFP_KERNEL);
+	if (!mux)
+		return ERR_PTR(-ENOMEM);
+
+	mux->closing = kcalloc(BITS_TO_LONGS(session->adapter->nr_vterms),
+			       sizeof(unsigned long), GFP_KERNEL);
+	if (!mux->closing) {
+		kfree(mux);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	spin_lock_init(&mux->lock);
+	INIT_LIST_HEAD(&mux->members);
+	INIT_LIST_HEAD(&mux->ready);
+	init_waitqueue_head(&mux->wait);
+	mutex_init(&mux->rx_lock);
+	mutex_init(&mux->tx_lock);
+
+	/* File operations look at session->mux without vterm_mutex */
+	smp_store_release(&session->mux, mux);
+
+	return mux;
+}
+
+/**
+ * ibmvsm_mux_add - Make a freshly bound vterm a member of a session
+ *
+ * @mux:	ibmvsm_mux struct
+ * @vterm:	ibmvsm_vterm struct, bound to the session
+ *
+ * Must be called with adapter->vterm_mutex held.
+ *
+ * Return:
+ *	0 - Success
+ *	-EEXIST - Another member, maybe hung up, has the same console token
+ *	-ENOMEM - Out of memory
+ */
+static int ibmvsm_mux_add(struct ibmvsm_mux *mux, struct ibmvsm_vterm *vterm)
+{
+	struct ibmvsm_mux_member *member, *m;
+	int rc = 0;
+
+	member = kzalloc(sizeof(*member), GFP_KERNEL);
+	if (!member)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&member->ready);
+	member->mux = mux;
+	member->vterm = vterm;
+	member->token = vterm->open_token;
+	init_waitqueue_func_entry(&member->rx_wq, ibmvsm_mux_rx_wake);
+	init_waitqueue_func_entry(&member->tx_wq, ibmvsm_mux_tx_wake);
+
+	/* Only vterm_mutex holders add members, so this stays true */
+	spin_lock_irq(&mux->lock);
+	list_for_each_entry(m, &mux->members, node) {
+		if (m->token == member->token) {
+			rc = -EEXIST;
+			break;
+		}
+	}
+	spin_unlock_irq(&mux->lock);
+	if (rc) {
+		kfree(member);
+		return rc;
+	}
+
+	/* Hooked up first, so no wakeup is missed */
+	add_wait_queue(&vterm->rx_wait, &member->rx_wq);
+	add_wait_queue(&vterm->tx_wait, &member->tx_wq);
+
+	spin_lock_irq(&mux->lock);
+	list_add_tail(&member->node, &mux->members);
+	vterm->mux_member = member;
+	WRITE_ONCE(vterm->mux, mux);
+	/* Whatever arrived before it was hooked up */
+	if (list_empty(&member->ready))
+		list_add_tail(&member->ready, &mux->ready);
+	spin_unlock_irq(&mux->lock);
+
+	wake_up_interruptible_poll(&mux->wait, EPOLLIN | EPOLLRDNORM);
+
+	return 0;
+}
+
+/**
+ * ibmvsm_mux_mark_close - Pick a member of a session to close
+ *
+ * @mux:	ibmvsm_mux struct
+ * @token:	console token of the member
+ *
+ * A hung up member is dropped right away, a live one is marked in
+ * mux->closing for ibmvsm_mux_close_marked(). Must be called with
+ * adapter->vterm_mutex held.
+ *
+ * Return:
+ *	0 - Success
+ *	-ENOENT - No such member, or already marked
+ */
+static int ibmvsm_mux_mark_close(struct ibmvsm_mux *mux, u64 token)
+{
+	struct ibmvsm_mux_member *member;
+
+	spin_lock_irq(&mux->lock);
+	list_for_each_entry(member, &mux->members, node) {
+		if (member->token != token)
+			continue;
+
+		if (member->vterm) {
+			bool marked = test_and_set_bit(member->vterm->index,
+						       mux->closing);
+
+			spin_unlock_irq(&mux->lock);
+			return marked ? -ENOENT : 0;
+		}
+
+		list_del_init(&member->ready);
+		list_del(&member->node);
+		spin_unlock_irq(&mux->lock);
+		kfree(member);
+		return 0;
+	}
+	spin_unlock_irq(&mux->lock);
+
+	return -ENOENT;
+}
+
+/**
+ * ibmvsm_mux_close_marked - Close the members marked in mux->closing
+ *
+ * @adapter:	crq_server_adapter struct
+ * @mux:	ibmvsm_mux struct
+ *
+ * The closes share one RCU grace period. Must be called with
+ * adapter->vterm_mutex held.
+ */
+static void ibmvsm_mux_close_marked(struct crq_server_adapter *adapter,
+				    struct ibmvsm_mux *mux)
+{
+	bool opened = false;
+	unsigned int i;
+
+	for_each_set_bit(i, mux->closing, adapter->nr_vterms) {
+		ibmvsm_mux_unlink(adapter->vterms[i], false);
+		opened |= ibmvsm_vterm_shutdown(adapter->vterms[i]);
+	}
+
+	/* Tokens may be reused once the vterms are back in the pool */
+	if (opened)
+		synchronize_rcu();
+
+	for_each_set_bit(i, mux->closing, adapter->nr_vterms)
+		ibmvsm_vterm_release(adapter->vterms[i], true);
+	bitmap_zero(mux->closing, adapter->nr_vterms);
+}
+
+/**
+ * ibmvsm_mux_release - Close all members of a session being closed
+ *
+ * @adapter:	crq_server_adapter struct
+ * @mux:	ibmvsm_mux struct, freed
+ *
+ * Must be called with adapter->vterm_mutex held.
+ */
+static void ibmvsm_mux_release(struct crq_server_adapter *adapter,
+			       struct ibmvsm_mux *mux)
+{
+	struct ibmvsm_mux_member *member, *tmp;
+
+	spin_lock_irq(&mux->lock);
+	list_for_each_entry_safe(member, tmp, &mux->members, node) {
+		if (member->vterm) {
+			set_bit(member->vterm->index, mux->closing);
+			continue;
+		}
+
+		list_del(&member->node);
+		kfree(member);
+	}
+	spin_unlock_irq(&mux->lock);
+
+	ibmvsm_mux_close_marked(adapter, mux);
+	kfree(mux->closing);
+	kfree(mux);
+}
+
+/**
+ * ibmvsm_ioctl_mux_open - IOCTL open vterms into a multiplexed session
+ *
+ * @session:	ibmvsm_file_session struct
+ * @ubatch:	struct ibmvsm_open_batch, flags must be 0
+ *
+ * The first call switches an unbound session to multiplex mode. Every
+ * entry's vterm is opened as a member of the session, reads and writes
+ * of which then carry framed records; entries get no fd of their own.
+ *
+ * Return:
+ *	Number of vterms opened - Success
+ *	Negative - Failure, nothing was opened
+ */
+static long ibmvsm_ioctl_mux_open(struct ibmvsm_file_session *session,
+				  struct ibmvsm_open_batch __user *ubatch)
+{
+	struct crq_server_adapter *adapter = session->adapter;
+	struct ibmvsm_open_entry __user *uentries;
+	struct ibmvsm_open_entry *entries;
+	struct ibmvsm_open_batch batch;
+	struct ibmvsm_vterm *vterm;
+	struct ibmvsm_setid id;
+	struct ibmvsm_mux *mux;
+	long rc, opened = 0;
+	u32 i;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+
+	if (!batch.count || batch.count > adapter->nr_vterms || batch.flags)
+		return -EINVAL;
+
+	uentries = u64_to_user_ptr(batch.entries);
+	entries = memdup_user(uentries, batch.count * sizeof(*entries));
+	if (IS_ERR(entries))
+		return PTR_ERR(entries);
+
+	mutex_lock(&adapter->vterm_mutex);
+	mux = ibmvsm_mux_get(session);
+	if (IS_ERR(mux)) {
+		mutex_unlock(&adapter->vterm_mutex);
+		rc = PTR_ERR(mux);
+		goto free_entries;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		entries[i].console_token = 0;
+		entries[i].fd = -1;
+		id.session_id = entries[i].session_id;
+		id.partition_id = entries[i].partition_id;
+
+		vterm = ibmvsm_vterm_bind(session, &id);
+		if (IS_ERR(vterm)) {
+			entries[i].status = PTR_ERR(vterm);
+			continue;
+		}
+
+		rc = ibmvsm_mux_add(mux, vterm);
+		if (rc) {
+			ibmvsm_vterm_close(vterm);
+			entries[i].status = rc;
+			continue;
+		}
+
+		entries[i].console_token = vterm->open_token;
+		entries[i].status = 0;
+		opened++;
+	}
+	mutex_unlock(&adapter->vterm_mutex);
+	rc = opened;
+
+	if (copy_to_user(uentries, entries, batch.count * sizeof(*entries))) {
+		/* Nobody learned the tokens, close what was opened */
+		mutex_lock(&adapter->vterm_mutex);
+		for (i = 0; i < batch.count; i++)
+			if (!entries[i].status)
+				ibmvsm_mux_mark_close(mux,
+						      entries[i].console_token);
+		ibmvsm_mux_close_marked(adapter, mux);
+		mutex_unlock(&adapter->vterm_mutex);
+		rc = -EFAULT;
+	}
+
+free_entries:
+	kfree(entries);
+	return rc;
+}
+
+/**
+ * ibmvsm_ioctl_mux_close - IOCTL close members of a multiplexed session
+ *
+ * @session:	ibmvsm_file_session struct
+ * @ubatch:	struct ibmvsm_close_batch, by the tokens records carry
+ *
+ * Closes members like VSM_IOCTL_CLOSE_BATCH closes vterms, sharing one
+ * RCU grace period. Also drops members that hung up before their hangup
+ * record was read.
+ *
+ * Return:
+ *	Number of members closed - Success
+ *	Negative - Failure, nothing was closed
+ */
+static long ibmvsm_ioctl_mux_close(struct ibmvsm_file_session *session,
+				   struct ibmvsm_close_batch __user *ubatch)
+{
+	struct crq_server_adapter *adapter = session->adapter;
+	struct ibmvsm_close_entry __user *uentries;
+	struct ibmvsm_close_entry *entries;
+	struct ibmvsm_close_batch batch;
+	struct ibmvsm_mux *mux;
+	long rc = 0;
+	u32 i;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+
+	if (!batch.count || batch.count > adapter->nr_vterms || batch.flags)
+		return -EINVAL;
+
+	uentries = u64_to_user_ptr(batch.entries);
+	entries = memdup_user(uentries, batch.count * sizeof(*entries));
+	if (IS_ERR(entries))
+		return PTR_ERR(entries);
+
+	mutex_lock(&adapter->vterm_mutex);
+	mux = session->mux;
+	if (!mux) {
+		mutex_unlock(&adapter->vterm_mutex);
+		rc = -EINVAL;
+		goto free_entries;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		entries[i].status = ibmvsm_mux_mark_close(mux,
+						entries[i].console_token);
+		if (!entries[i].status)
+			rc++;
+	}
+	ibmvsm_mux_close_marked(adapter, mux);
+	mutex_unlock(&adapter->vterm_mutex);
+
+	if (copy_to_user(uentries, entries, batch.count * sizeof(*entries)))
+		rc = -EFAULT;
+
+free_entries:
+	kfree(entries);
+	return rc;
+}
+
+/**
+ * ibmvsm_obs_release - Stop observing when the session is closed
+ *
+ * @obs:	ibmvsm_observer struct, freed
+ *
+ * Must be called with adapter->vterm_mutex held, which keeps the rings of
+ * a vterm that has not hung the observer up.
+ */
+static void ibmvsm_obs_release(struct ibmvsm_observer *obs)
+{
+	struct ibmvsm_vterm *vterm = obs->vterm;
+	bool kick = false;
+
+	spin_lock_bh(&vterm->lock);
+	if (!obs->hup) {
+		list_del(&obs->node);
+		if (obs->block) {
+			ibmvsm_obs_update_hold(vterm);
+			kick = true;
+		}
+	}
+	spin_unlock_bh(&vterm->lock);
+
+	if (kick)
+		ibmvsm_rx_kick(vterm);
+	kfree(obs);
+}
+
+/**
+ * ibmvsm_ioctl_observe - IOCTL follow an open vterm read-only
+ *
+ * @session:	ibmvsm_file_session struct, not bound
+ * @uobserve:	ibmvsm_observe struct
+ *
+ * Turns the session into an observer of a vterm another session has open.
+ * It reads everything received from then on from the same receive ring,
+ * with a cursor of its own, so observers add no hcalls. A drop-oldest
+ * observer that falls a ring behind skips ahead, a VSM_OBSERVE_BLOCK one
+ * stalls receive for the vterm until it catches up. Writing is refused.
+ *
+ * Return:
+ *	0 - Success
+ *	Non-zero - Failure
+ */
+static long ibmvsm_ioctl_observe(struct ibmvsm_file_session *session,
+				 struct ibmvsm_observe __user *uobserve)
+{
+	struct crq_server_adapter *adapter = session->adapter;
+	struct ibmvsm_observe observe;
+	struct ibmvsm_observer *obs;
+	struct ibmvsm_vterm *vterm;
+	long rc = 0;
+
+	if (copy_from_user(&observe, uobserve, sizeof(observe)))
+		return -EFAULT;
+
+	if (observe.flags & ~VSM_OBSERVE_BLOCK || observe.rsvd)
+		return -EINVAL;
+
+	obs = kzalloc(sizeof(*obs), GFP_KERNEL);
+	if (!obs)
+		return -ENOMEM;
+
+	mutex_lock(&adapter->vterm_mutex);
+	if (session->valid || session->mux || session->observer) {
+		rc = -EBUSY;
+		goto unlock;
+	}
+
+	vterm = ibmvsm_find_open(adapter, observe.console_token);
+	/* A detached vterm has no rings to share */
+	if (!vterm || vterm->detached || !ibmvsm_vterm_alive(vterm)) {
+		rc = -ENOENT;
+		goto unlock;
+	}
+
+	obs->vterm = vterm;
+	obs->block = observe.flags & VSM_OBSERVE_BLOCK;
+
+	spin_lock_bh(&vterm->lock);
+	obs->cursor = READ_ONCE(vterm->rx_head);
+	list_add_tail(&obs->node, &vterm->observers);
+	if (obs->block)
+		ibmvsm_obs_update_hold(vterm);
+	spin_unlock_bh(&vterm->lock);
+
+	smp_store_release(&session->observer, obs);
+	obs = NULL;
+
+unlock:
+	mutex_unlock(&adapter->vterm_mutex);
+	kfree(obs);
+	return rc;
+}
+
+/**
+ * ibmvsm_ioctl - IOCTL
+ *
+ * @session:	ibmvsm_file_session struct
+ * @cmd:	cmd field
+ * @arg:	Argument field
+ *
+ * Return:
+ *	0 - Success
+ *	Non-zero - Failure
+ */
+static long ibmvsm_ioctl(struct file *file,
+			 unsigned int cmd, unsigned long arg)
+{
+	struct ibmvsm_file_session *session = file->private_data;
+
+	pr_debug("ibmvsm: ioctl file=0x%lx, cmd=0x%x, arg=0x%lx, ses=0x%lx\n",
+		 (unsigned long)file, cmd, arg,
+		 (unsigned long)session);
+
+	if (!session) {
+		pr_warn("ibmvsm: ioctl: no session\n");
+		return -EIO;
+	}
+
+	/* Same argument, only the size in the number differs */
+	if (cmd == VSM_IOCTL_SETID_OLD)
+		cmd = VSM_IOCTL_SETID;
+
+	switch (cmd) {
+	case VSM_IOCTL_SETID:
+		return ibmvsm_ioctl_setid(session,
+				(struct ibmvsm_setid __user *)arg);
+	case VSM_IOCTL_KICK:
+		return ibmvsm_ioctl_kick(session);
+	case VSM_IOCTL_OPEN_BATCH:
+		return ibmvsm_ioctl_open_batch(session,
+				(struct ibmvsm_open_batch __user *)arg);
+	case VSM_IOCTL_CLOSE_BATCH:
+		return ibmvsm_ioctl_close_batch(session,
+				(struct ibmvsm_close_batch __user *)arg);
+	case VSM_IOCTL_TX_PRIO:
+		return ibmvsm_ioctl_tx_prio(session,
+				(struct ibmvsm_tx_prio __user *)arg);
+	case VSM_IOCTL_GET_HISTORY:
+		return ibmvsm_ioctl_get_history(session,
+				(struct ibmvsm_history __user *)arg);
+	case VSM_IOCTL_LINGER:
+		return ibmvsm_ioctl_linger(session, (u32 __user *)arg);
+	case VSM_IOCTL_MUX_OPEN:
+		return ibmvsm_ioctl_mux_open(session,
+				(struct ibmvsm_open_batch __user *)arg);
+	case VSM_IOCTL_MUX_CLOSE:
+		return ibmvsm_ioctl_mux_close(session,
+				(struct ibmvsm_close_batch __user *)arg);
+	case VSM_IOCTL_OBSERVE:
+		return ibmvsm_ioctl_observe(session,
+				(struct ibmvsm_observe __user *)arg);
+	default:
+		pr_warn("ibmvsm: unknown ioctl 0x%x\n", cmd);
+		return -EINVAL;
+	}
+}
+
+/**
+ * ibmvsm_mmap - Map the rings of a bound session
+ *
+ * @file:	file struct
+ * @vma:	vm_area_struct to fill
+ *
+ * VSM_MMAP_CTRL maps the struct ibmvsm_mmap_ctrl holding the indices of
+ * both rings, VSM_MMAP_RX and VSM_MMAP_TX the ring data. Once the vterm is
+ * closed the kernel stops using the pages, but they stay mapped until the
+ * session unmaps them.
+ *
+ * Return:
+ *	0 - Success
+ *	Non-zero - Failure
+ */
+static int ibmvsm_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ibmvsm_file_session *session = file->private_data;
+	struct crq_server_adapter *adapter;
+	struct ibmvsm_vterm *vterm;
+	void *area;
+	int rc;
+
+	if (!session)
+		return -EIO;
+
+	adapter = session->adapter;
+	mutex_lock(&adapter->vterm_mutex);
+	if (!session->valid) {
+		rc = -EIO;
+		goto out;
+	}
+
+	vterm = session->vterm;
+	switch ((u64)vma->vm_pgoff << PAGE_SHIFT) {
+	case VSM_MMAP_CTRL:
+		area = vterm->ctrl;
+		break;
+	case VSM_MMAP_RX:
+		area = vterm->rx.buf;
+		break;
+	case VSM_MMAP_TX:
+		area = vterm->tx.buf;
+		break;
+	default:
+		rc = -EINVAL;
+		goto out;
+	}
+
+	/* Fails if the mapping is larger than the area */
+	rc = remap_vmalloc_range(vma, area, 0);
+out:
+	mutex_unlock(&adapter->vterm_mutex);
+	return rc;
+}
+
+static void ibmvsm_adapter_release(struct kref *kref);
+
+/**
+ * ibmvsm_open - Open Session
+ *
+ * @inode:	inode struct
+ * @file:	file struct
+ *
+ * The session holds a reference on the adapter whose misc device was
+ * opened, so the adapter outlives a remove until the file is closed.
+ *
+ * Return:
+ *	0 - Success
+ *	Non-zero - Failure
+ */
+static int ibmvsm_open(struct inode *inode, struct file *file)
+{
+	struct crq_server_adapter *adapter =
+		container_of(file->private_data, struct crq_server_adapter,
+			     miscdev);
+	struct ibmvsm_file_session *session;
+
+	pr_debug("%s: inode = 0x%lx, file = 0x%lx, state = 0x%x\n", __func__,
+		 (unsigned long)inode, (unsigned long)file,
+		 adapter->state);
+
+	session = kzalloc(sizeof(*session), GFP_KERNEL);
+	if (!session)
+		return -ENOMEM;
+
+	kref_get(&adapter->kref);
+	session->adapter = adapter;
+	session->id = atomic64_inc_return(&ibmvsm_session_ids);
+	session->file = file;
+	file->private_data = session;
+	file->f_mode |= FMODE_NOWAIT;
+
+	return 0;
+}
+
+/**
+ * ibmvsm_close - Close Session
+ *
+ * @inode:	inode struct
+ * @file:	file struct
+ *
+ * Return:
+ *	0 - Success
+ *	Non-zero - Failure
+ */
+static int ibmvsm_close(struct inode *inode, struct file *file)
+{
+	struct ibmvsm_file_session *session;
+	struct crq_server_adapter *adapter;
+	int rc = 0;
+
+	session = file->private_data;
+	if (!session)
+		return -EIO;
+
+	adapter = session->adapter;
+	pr_debug("%s: file = 0x%lx, state = 0x%x\n", __func__,
+		 (unsigned long)file, adapter->state);
+
+	/* Do ibmvsm session specific stuff like check if vsm adapter
+	 * available if not return -EIO, check if state is failed.
+	 * if failed state then return -EIO. Then check if vsm state
+	 * is trying to open again if so then close it.
+	 */
+	mutex_lock(&adapter->vterm_mutex);
+	if (session->mux) {
+		ibmvsm_mux_release(adapter, session->mux);
+	} else if (session->observer) {
+		ibmvsm_obs_release(session->observer);
+	} else if (session->valid) {
+		if (session->vterm->linger &&
+		    ibmvsm_vterm_alive(session->vterm))
+			ibmvsm_vterm_detach(session->vterm);
+		else
+			ibmvsm_vterm_close(session->vterm);
+	} else if (session->vterm) {
+		/* Closed underneath the session, see ibmvsm_vterm_orphan() */
+		ibmvsm_vterm_put(session->vterm);
+	}
+	mutex_unlock(&adapter->vterm_mutex);
+
+	kzfree(session);
+	kref_put(&adapter->kref, ibmvsm_adapter_release);
+
+	return rc;
+}
+
+static const struct file_operations ibmvsm_fops = {
+	.owner		= THIS_MODULE,
+	.read_iter	= ibmvsm_read_iter,
+	.write_iter	= ibmvsm_write_iter,
+	.splice_read	= generic_file_splice_read,
+	.poll		= ibmvsm_poll,
+	.mmap		= ibmvsm_mmap,
+	.unlocked_ioctl	= ibmvsm_ioctl,
+	.open           = ibmvsm_open,
+	.release        = ibmvsm_close,
+};
+
+/* routines for managing a command/response queue */
+/**
+ * ibmvsm_coalesce_check - Switch to polling if interrupts come too fast
+ *
+ * @adapter:	crq_server_adapter struct
+ *
+ * Counts CRQ interrupts per IBMVSM_COALESCE_WINDOW_NS window. Once a
+ * window sees more than coalesce_irq_rate allows, the adapter goes into
+ * polling mode: CRQ processing leaves interrupts off and serves the queue
+ * from poll_timer until it has been idle for coalesce_idle_polls polls.
+ * Called from the interrupt handler, which is the only user of the
+ * window fields.
+ */
+static void ibmvsm_coalesce_check(struct crq_server_adapter *adapter)
+{
+	unsigned int rate = READ_ONCE(coalesce_irq_rate);
+	unsigned int limit;
+	ktime_t now;
+
+	if (!rate)
+		return;
+
+	now = ktime_get();
+	if (ktime_after(now, adapter->irq_window)) {
+		adapter->irq_window = ktime_add_ns(now,
+						   IBMVSM_COALESCE_WINDOW_NS);
+		adapter->irq_count = 0;
+	}
+
+	limit = max_t(unsigned int,
+		      rate / (NSEC_PER_SEC / IBMVSM_COALESCE_WINDOW_NS), 1);
+	if (++adapter->irq_count <= limit)
+		return;
+
+	/* Start a fresh window once interrupts come back on */
+	adapter->irq_window = 0;
+	WRITE_ONCE(adapter->polling, true);
+	ibmvsm_adapter_stat_add(adapter, IBMVSM_STAT_CRQ_COALESCE, 1);
+	trace_crq_coalesce(adapter, true);
+}
+
+/**
+ * ibmvsm_coalesce_idle - Keep polling an idle CRQ, or go back to interrupts
+ *
+ * @adapter:	crq_server_adapter struct
+ * @done:	CRQ entries handled by this pass
+ *
+ * Called by CRQ processing with interrupts off and the queue empty. In
+ * polling mode this arms poll_timer for the next pass, unless the queue
+ * has now been empty for coalesce_idle_polls passes in a row, in which
+ * case polling mode ends.
+ *
+ * Return:
+ *	true - Polling, leave interrupts off
+ *	false - Not polling, the caller re-enables interrupts
+ */
+static bool ibmvsm_coalesce_idle(struct crq_server_adapter *adapter,
+				 unsigned int done)
+{
+	if (!READ_ONCE(adapter->polling))
+		return false;
+
+	if (done) {
+		adapter->poll_idle = 0;
+	} else if (++adapter->poll_idle >= READ_ONCE(coalesce_idle_polls)) {
+		adapter->poll_idle = 0;
+		WRITE_ONCE(adapter->polling, false);
+		trace_crq_coalesce(adapter, false);
+		return false;
+	}
+
+	hrtimer_start(&adapter->poll_timer,
+		      ns_to_ktime((u64)READ_ONCE(coalesce_usecs) * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+	return true;
+}
+
+/**
+ * ibmvsm_poll_timer - Run a CRQ processing pass while coalescing
+ *
+ * @timer:	poll_timer embedded in the crq_server_adapter
+ */
+static enum hrtimer_restart ibmvsm_poll_timer(struct hrtimer *timer)
+{
+	struct crq_server_adapter *adapter =
+		container_of(timer, struct crq_server_adapter, poll_timer);
+
+	ibmvsm_adapter_stat_add(adapter, IBMVSM_STAT_CRQ_POLLS, 1);
+	ibmvsm_schedule_crq(adapter);
+
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * ibmvsm_handle_event: - Interrupt handler for crq events
+ * @irq:        number of irq to handle, not used
+ * @dev_instance: crq_server_adapter that received interrupt
+ *
+ * Disables interrupts and schedules CRQ processing. If interrupts arrive
+ * faster than coalesce_irq_rate the adapter switches to polling mode.
+ *
+ * Always returns IRQ_HANDLED
+ */
+static irqreturn_t ibmvsm_handle_event(int irq, void *dev_instance)
+{
+	struct crq_server_adapter *adapter =
+		(struct crq_server_adapter *)dev_instance;
+
+	adapter->ops->disable_interrupts(adapter);
+	ibmvsm_adapter_stat_add(adapter, IBMVSM_STAT_CRQ_IRQS, 1);
+	ibmvsm_coalesce_check(adapter);
+	ibmvsm_schedule_crq(adapter);
+
+	return IRQ_HANDLED;
+}
+
+/**
+ * ibmvsm_reset_crq_queue - Reset CRQ Queue
+ *
+ * @adapter:	crq_server_adapter struct
+ *
+ * This function calls h_free_crq and then calls H_REG_CRQ and does all the
+ * bookkeeping to get us back to where we can communicate.
+ *
+ * Return:
+ *	0 - Success
+ *	Non-Zero - Failure
+ */
+static int ibmvsm_reset_crq_queue(struct crq_server_adapter *adapter)
+{
+	struct crq_queue *queue = &adapter->queue;
+	int rc = 0;
+
+	/* Close the CRQ */
+	h_free_crq(adapter);
+
+	/* Clean out the queue, no CRQ processing pass is in flight */
+	memset(queue->msgs, 0x00, PAGE_SIZE << queue->order);
+	queue->cur = 0;
+
+	/* And re-open it again */
+	rc = h_reg_crq(adapter);
+	if (rc == 2)
+		/* Adapter is good, but other end is not ready */
+		dev_warn(adapter->dev, "Partner adapter not ready\n");
+	else if (rc != 0)
+		dev_err(adapter->dev, "couldn't register crq--rc 0x%x\n", rc);
+
+	return rc;
+}
+
+/**
+ * ibmvsm_set_version - Record the outcome of the version exchange
+ *
+ * @adapter:	crq_server_adapter struct
+ * @version:	partner protocol version, 0 if it has no version exchange
+ * @max_chars:	partner bytes per get/put chars hcall
+ * @max_vterms:	vterms the partner allows open at once
+ *
+ * Takes the lower of each limit and schedules the vterms to be reopened,
+ * after which the adapter is ready. Called from CRQ processing.
+ */
+static void ibmvsm_set_version(struct crq_server_adapter *adapter,
+			       u16 version, u32 max_chars, u32 max_vterms)
+{
+	adapter->version_wait = false;
+	cancel_delayed_work(&adapter->version_work);
+
+	adapter->version = min_t(u16, version, IBMVSM_PROTOCOL_VERSION);
+	WRITE_ONCE(adapter->max_chars,
+		   min(max_chars, ibmvsm_local_max_chars(adapter)));
+	WRITE_ONCE(adapter->max_open, min(max_vterms, adapter->nr_vterms));
+
+	dev_info(adapter->dev, "version %u, %u chars per hcall, %u vterms\n",
+		 adapter->version, adapter->max_chars, adapter->max_open);
+
+	schedule_work(&adapter->resume_work);
+}
+
+/**
+ * ibmvsm_handle_version - Handle the partner's version exchange answer
+ *
+ * @adapter:	crq_server_adapter struct
+ * @crq:	ibmvsm_crq_msg struct
+ *
+ * A partner that rejects the exchange with VSM_MSG_ERR, or answers with
+ * limits of zero, is driven with the limits of a pre-negotiation partner.
+ */
+static void ibmvsm_handle_version(struct crq_server_adapter *adapter,
+				  struct ibmvsm_crq_msg *crq)
+{
+	struct ibmvsm_crq_version *rsp = (struct ibmvsm_crq_version *)crq;
+	u32 max_chars = be16_to_cpu(rsp->max_chars);
+	u32 max_vterms = be16_to_cpu(rsp->max_vterms);
+
+	if (adapter->state != ibmvsm_state_capabilities ||
+	    !adapter->version_wait) {
+		dev_warn(adapter->dev, "CRQ recv: version msg 0x%x in state 0x%x\n",
+			 crq->type, adapter->state);
+		return;
+	}
+
+	if (crq->type == VSM_MSG_ERR) {
+		dev_warn(adapter->dev, "Partner rejected version exchange\n");
+	} else if (!rsp->version || !max_chars || !max_vterms) {
+		dev_warn(adapter->dev, "Invalid version exchange rsp, version %u chars %u vterms %u\n",
+			 be16_to_cpu(rsp->version), max_chars, max_vterms);
+	} else {
+		ibmvsm_set_version(adapter, be16_to_cpu(rsp->version),
+				   max_chars, max_vterms);
+		return;
+	}
+
+	ibmvsm_set_version(adapter, 0, IBMVSM_DEFAULT_CHARS,
+			   adapter->nr_vterms);
+}
+
+/**
+ * ibmvsm_version_timeout - Give up waiting for the version exchange answer
+ *
+ * @work:	version_work embedded in the crq_server_adapter
+ *
+ * Only kicks CRQ processing, which falls back in ibmvsm_version_check()
+ * so that a late answer and the fallback cannot both apply.
+ */
+static void ibmvsm_version_timeout(struct work_struct *work)
+{
+	struct crq_server_adapter *adapter =
+		container_of(to_delayed_work(work), struct crq_server_adapter,
+			     version_work);
+
+	ibmvsm_schedule_crq(adapter);
+}
+
+/**
+ * ibmvsm_version_check - Fall back if the version exchange went unanswered
+ *
+ * @adapter:	crq_server_adapter struct
+ *
+ * A partner that ignores VSM_MSG_VER_EXCH would otherwise leave the adapter
+ * in ibmvsm_state_capabilities for good. After IBMVSM_VERSION_TIMEOUT_MS it
+ * is driven like one that rejected the exchange. Called from CRQ
+ * processing.
+ */
+static void ibmvsm_version_check(struct crq_server_adapter *adapter)
+{
+	if (!adapter->version_wait ||
+	    adapter->state != ibmvsm_state_capabilities ||
+	    time_before(jiffies, adapter->version_deadline))
+		return;
+
+	dev_warn(adapter->dev, "No answer to version exchange\n");
+	ibmvsm_set_version(adapter, 0, IBMVSM_DEFAULT_CHARS,
+			   adapter->nr_vterms);
+}
+
+/**
+ * ibmvsm_crq_process - Process CRQ
+ *
+ * @adapter:    crq_server_adapter struct
+ * @crq:	ibmvsm_crq_msg struct
+ *
+ * Process the CRQ message based upon the type of message received.
+ *
+ */
+static void ibmvsm_crq_process(struct crq_server_adapter *adapter,
+			       struct ibmvsm_crq_msg *crq)
+{
+	struct ibmvsm_vterm *vterm;
+
+	switch (crq->type) {
+	case VSM_MSG_SIG_VTERM_INT:
+		rcu_read_lock();
+		vterm = ibmvsm_find_vterm(adapter,
+					  be64_to_cpu(crq->console_token));
+		rcu_read_unlock();
+		/* The vterm stays allocated, receive rechecks it is open */
+		if (vterm)
+			ibmvsm_vterm_rx(vterm);
+		else
+			dev_dbg(adapter->dev, "CRQ recv: signal for unknown vterm 0x%llx\n",
+				be64_to_cpu(crq->console_token));
+		break;
+	case VSM_MSG_VERSION_EXCH_RSP:
+	case VSM_MSG_ERR:
+		ibmvsm_handle_version(adapter, crq);
+		break;
+	case VSM_MSG_VER_EXCH:
+	case VSM_MSG_VTERM_INT:
+		dev_warn(adapter->dev, "CRQ recv: unexpected msg (0x%x)\n",
+			 crq->type);
+		break;
+	default:
+		dev_warn(adapter->dev, "CRQ recv: unknown msg (0x%x)\n",
+			 crq->type);
+		break;
+	}
+}
+
+/**
+ * ibmvsm_suspend_vterms - Park open vterms across a CRQ reset
+ *
+ * @adapter:	crq_server_adapter struct
+ *
+ * Suspended vterms keep their file session and both rings but make no
+ * hcalls until ibmvsm_resume_task() reopens them.
+ */
+static void ibmvsm_suspend_vterms(struct crq_server_adapter *adapter)
+{
+	struct ibmvsm_vterm *vterm;
+	unsigned int i;
+
+	for (i = 0; i < adapter->nr_vterms; i++) {
+		vterm = adapter->vterms[i];
+		spin_lock_bh(&vterm->lock);
+		if (vterm->state == ibmvterm_state_ready)
+			ibmvsm_vterm_set_state(vterm, ibmvterm_state_suspended);
+		spin_unlock_bh(&vterm->lock);
+	}
+}
+
+/**
+ * ibmvsm_reset - Reset
+ *
+ * @adapter:	crq_server_adapter struct
+ * @xport_event:	export_event field
+ *
+ * Suspends all open vterms and conditionally schedules a CRQ reset. The
+ * file sessions stay open; once CRQ initialization completes the vterms
+ * are reopened and carry on with the data still in their rings. Called
+ * from CRQ processing. queue.lock is only taken around the state change,
+ * to serialize it with the reset and resume tasks.
+ * @xport_event: If true, the partner closed their CRQ; we don't need to reset.
+ *               If false, we need to schedule a CRQ reset.
+ */
+static void ibmvsm_reset(struct crq_server_adapter *adapter, bool xport_event)
+{
+	trace_crq_reset(adapter, xport_event);
+
+	spin_lock_bh(&adapter->queue.lock);
+	if (adapter->state == ibmvsm_state_failed ||
+	    adapter->state == ibmvsm_state_sched_reset) {
+		spin_unlock_bh(&adapter->queue.lock);
+		return;
+	}
+
+	/* Before suspending, so setid cannot mark a new vterm ready after */
+	WRITE_ONCE(adapter->resetting, true);
+	WRITE_ONCE(adapter->resets, adapter->resets + 1);
+	adapter->state = xport_event ? ibmvsm_state_crqinit :
+				       ibmvsm_state_sched_reset;
+	spin_unlock_bh(&adapter->queue.lock);
+
+	ibmvsm_suspend_vterms(adapter);
+
+	if (xport_event)
+		/* Our end of the CRQ is fine. Offer to initialize again; if
+		 * the partner is not back yet it sends its own init msg.
+		 */
+		ibmvsm_send_init_msg(adapter, CRQ_INIT);
+	else
+		/* The CRQ reset may sleep, do it in process context */
+		schedule_work(&adapter->reset_work);
+}
+
+static void ibmvsm_close_vterms(struct crq_server_adapter *adapter);
+
+/**
+ * ibmvsm_reset_task - Reset the CRQ
+ *
+ * @work:	reset_work embedded in the crq_server_adapter
+ *
+ * Re-registers the CRQ and starts CRQ initialization again. If the CRQ
+ * cannot be registered the vterms are closed, failing their sessions.
+ */
+static void ibmvsm_reset_task(struct work_struct *work)
+{
+	struct crq_server_adapter *adapter =
+		container_of(work, struct crq_server_adapter, reset_work);
+	int rc;
+
+	if (READ_ONCE(adapter->state) != ibmvsm_state_sched_reset)
+		return;
+
+	/* The pass that asked for the reset may still be finishing */
+	ibmvsm_sync_crq(adapter);
+	rc = ibmvsm_reset_crq_queue(adapter);
+	if (rc != H_SUCCESS && rc != H_CLOSED) {
+		ibmvsm_close_vterms(adapter);
+		return;
+	}
+
+	spin_lock_bh(&adapter->queue.lock);
+	/* Start over in interrupt mode, interrupts are turned on below */
+	adapter->polling = false;
+	adapter->poll_idle = 0;
+	if (adapter->state == ibmvsm_state_sched_reset)
+		adapter->state = ibmvsm_state_crqinit;
+	spin_unlock_bh(&adapter->queue.lock);
+
+	/* The pass that saw the reset request left interrupts off */
+	adapter->ops->enable_interrupts(adapter);
+	ibmvsm_schedule_crq(adapter);
+
+	/* If the partner is not ready it sends its own init msg later */
+	ibmvsm_send_init_msg(adapter, CRQ_INIT);
+}
+
+/**
+ * ibmvsm_vterm_reopen - Reopen a vterm suspended by a CRQ reset
+ *
+ * @vterm:	ibmvsm_vterm struct, unhashed
+ * @resets:	adapter->resets when resuming started
+ *
+ * Must be called with adapter->vterm_mutex held. If another reset has
+ * started meanwhile the vterm stays suspended for that one to reopen.
+ */
+static void ibmvsm_vterm_reopen(struct ibmvsm_vterm *vterm, u32 resets)
+{
+	struct crq_server_adapter *adapter = vterm->adapter;
+	u64 token;
+	long rc;
+
+	/* The hypervisor has likely dropped the old token already */
+	ibmvsm_adapter_stat_add(adapter, IBMVSM_STAT_CLOSE_VTERM, 1);
+	h_close_vterm_lp(adapter, vterm->console_token);
+
+	ibmvsm_adapter_stat_add(adapter, IBMVSM_STAT_OPEN_VTERM, 1);
+	rc = h_open_vterm_lp(adapter, vterm->session_id, vterm->partition_id,
+			     &token);
+	if (rc != H_SUCCESS) {
+		dev_err(adapter->dev, "reopen vterm sid 0x%x pid 0x%x failed, rc %ld\n",
+			vterm->session_id, vterm->partition_id, rc);
+		/* Already closed and unhashed, so just free its resources */
+		spin_lock_bh(&vterm->lock);
+		ibmvsm_vterm_set_state(vterm, ibmvterm_state_initial);
+		spin_unlock_bh(&vterm->lock);
+		ibmvsm_vterm_orphan(vterm);
+		ibmvsm_vterm_close(vterm);
+		return;
+	}
+
+	spin_lock_bh(&vterm->lock);
+	vterm->console_token = token;
+	if (READ_ONCE(adapter->resets) == resets)
+		ibmvsm_vterm_set_state(vterm, ibmvterm_state_ready);
+	spin_unlock_bh(&vterm->lock);
+	hash_add_rcu(adapter->vterm_hash, &vterm->hash_node, token);
+
+	/* Pick up receive data left in firmware and unsent transmit data */
+	set_bit(vterm->index, adapter->rx_pending);
+	ibmvsm_schedule_crq(adapter);
+	ibmvsm_tx_activate(vterm);
+}
+
+/**
+ * ibmvsm_resume_task - Reopen vterms suspended by a CRQ reset
+ *
+ * @work:	resume_work embedded in the crq_server_adapter
+ *
+ * Runs once the version exchange completes, then marks the adapter ready.
+ */
+static void ibmvsm_resume_task(struct work_struct *work)
+{
+	struct crq_server_adapter *adapter =
+		container_of(work, struct crq_server_adapter, resume_work);
+	struct ibmvsm_vterm *vterm;
+	bool stale = false;
+	unsigned int i;
+	u32 resets;
+
+	mutex_lock(&adapter->vterm_mutex);
+	spin_lock_bh(&adapter->queue.lock);
+	resets = adapter->resets;
+	spin_unlock_bh(&adapter->queue.lock);
+
+	if (READ_ONCE(adapter->state) != ibmvsm_state_capabilities)
+		goto out;
+
+	/* Tokens change on reopen, so unhash all old ones and wait once */
+	for (i = 0; i < adapter->nr_vterms; i++) {
+		vterm = adapter->vterms[i];
+		if (vterm->state == ibmvterm_state_suspended) {
+			hash_del_rcu(&vterm->hash_node);
+			stale = true;
+		}
+	}
+	if (stale)
+		synchronize_rcu();
+
+	for (i = 0; i < adapter->nr_vterms; i++) {
+		vterm = adapter->vterms[i];
+		if (vterm->state == ibmvterm_state_suspended)
+			ibmvsm_vterm_reopen(vterm, resets);
+	}
+
+	spin_lock_bh(&adapter->queue.lock);
+	if (adapter->resets == resets &&
+	    adapter->state == ibmvsm_state_capabilities) {
+		WRITE_ONCE(adapter->resetting, false);
+		adapter->state = ibmvsm_state_ready;
+	}
+	spin_unlock_bh(&adapter->queue.lock);
+out:
+	mutex_unlock(&adapter->vterm_mutex);
+}
+
+/**
+ * ibmvsm_start_version - Move on from CRQ initialization
+ *
+ * @adapter:	crq_server_adapter struct
+ *
+ * Both ends are up; negotiate limits before any vterm is opened. A backend
+ * whose partner has no version exchange gets the defaults right away
+ * rather than after IBMVSM_VERSION_TIMEOUT_MS on every probe and reset.
+ */
+static void ibmvsm_start_version(struct crq_server_adapter *adapter)
+{
+	unsigned long timeout = msecs_to_jiffies(IBMVSM_VERSION_TIMEOUT_MS);
+
+	adapter->state = ibmvsm_state_capabilities;
+	if (!adapter->ops->version_exchange) {
+		ibmvsm_set_version(adapter, 0, IBMVSM_DEFAULT_CHARS,
+				   adapter->nr_vterms);
+		return;
+	}
+
+	if (ibmvsm_send_version(adapter) != H_SUCCESS) {
+		dev_err(adapter->dev, "Unable to send version exchange\n");
+		ibmvsm_reset(adapter, false);
+		return;
+	}
+
+	adapter->version_wait = true;
+	adapter->version_deadline = jiffies + timeout;
+	mod_delayed_work(system_wq, &adapter->version_work, timeout);
+}
+
+/**
+ * ibmvsm_handle_crq_init - Handle CRQ Init
+ *
+ * @crq:	ibmvsm_crq_msg struct
+ * @adapter:	crq_server_adapter struct
+ *
+ * Handle the type of crq initialization based on whether
+ * it is a message or a response.
+ *
+ */
+static void ibmvsm_handle_crq_init(struct ibmvsm_crq_msg *crq,
+				   struct crq_server_adapter *adapter)
+{
+	switch (crq->type) {
+	case 0x01:	/* Initialization message */
+		dev_dbg(adapter->dev, "CRQ recv: CRQ init msg - state 0x%x\n",
+			adapter->state);
+		if (adapter->state == ibmvsm_state_crqinit) {
+			if (ibmvsm_send_init_msg(adapter, CRQ_INIT_COMPLETE) == 0) {
+				ibmvsm_start_version(adapter);
+			} else {
+				dev_err(adapter->dev, " Unable to send init rsp\n");
+			}
+		} else {
+			dev_err(adapter->dev, "Invalid state 0x%x\n",
+				adapter->state);
+		}
+
+		break;
+	case 0x02:	/* Initialization response */
+		dev_dbg(adapter->dev, "CRQ recv: initialization resp msg - state 0x%x\n",
+			adapter->state);
+		if (adapter->state == ibmvsm_state_crqinit)
+			ibmvsm_start_version(adapter);
+		break;
+	default:
+		dev_warn(adapter->dev, "Unknown crq message type 0x%lx\n",
+			 (unsigned long)crq->type);
+	}
+}
+
+/**
+ * ibmvsm_handle_crq - Handle CRQ
+ *
+ * @crq:	ibmvsm_crq_msg struct
  * @adapter:	crq_server_adapter struct
  *
- * This function calls h_free_crq and then calls H_REG_CRQ and does all the
- * bookkeeping to get us back to where we can communicate.
+ * Read the command elements from the command queue and execute the
+ * requests based upon the type of crq message.
+ *
+ */
+static void ibmvsm_handle_crq(struct ibmvsm_crq_msg *crq,
+			      struct crq_server_adapter *adapter)
+{
+	trace_crq_recv(adapter, crq);
+
+	switch (crq->valid) {
+	case 0xC0:		/* initialization */
+		ibmvsm_handle_crq_init(crq, adapter);
+		break;
+	case 0xFF:	/* Hypervisor telling us the connection is closed */
+		dev_warn(adapter->dev, "CRQ recv: virtual adapter failed - resetting.\n");
+		ibmvsm_reset(adapter, true);
+		break;
+	case 0x80:	/* real payload */
+		ibmvsm_crq_process(adapter, crq);
+		break;
+	default:
+		dev_warn(adapter->dev, "CRQ recv: unknown msg 0x%02x.\n",
+			 crq->valid);
+		break;
+	}
+}
+
+/**
+ * ibmvsm_process_crq - Process CRQ entries
+ *
+ * @adapter:	crq_server_adapter struct
+ *
+ * Processes at most crq_budget CRQ entries per pass. If the budget runs
+ * out the caller reschedules processing with interrupts still disabled, so
+ * a busy adapter cannot monopolize the CPU. Interrupts are only re-enabled
+ * once the queue is found empty.
+ *
+ * In polling mode (see ibmvsm_coalesce_check()) an empty queue does not
+ * re-enable interrupts; poll_timer schedules the next pass instead.
+ *
+ * No lock is held across the handlers. Once a reset is scheduled, passes
+ * return without touching the queue, and the reset task waits for the
+ * pass that scheduled it before clearing the queue.
+ *
+ * Return:
+ *	true - Budget exhausted, another pass is needed
+ *	false - Queue idle or reset scheduled
+ */
+static bool ibmvsm_process_crq(struct crq_server_adapter *adapter)
+{
+	unsigned int budget = max(READ_ONCE(crq_budget), 1U);
+	struct crq_queue *queue = &adapter->queue;
+	struct ibmvsm_crq_msg *crq;
+	unsigned int done = 0;
+	bool more = true;
+
+	/* Leave the queue and interrupts to the reset task */
+	if (READ_ONCE(adapter->state) == ibmvsm_state_sched_reset)
+		return false;
+
+	ibmvsm_adapter_stat_add(adapter, IBMVSM_STAT_CRQ_PASSES, 1);
+	ibmvsm_version_check(adapter);
+	ibmvsm_rx_resume(adapter);
+
+	while (done < budget) {
+		crq = crq_queue_next_crq(queue);
+		if (!crq) {
+			/* While coalescing, poll_timer runs the next pass */
+			if (ibmvsm_coalesce_idle(adapter, done)) {
+				more = false;
+				break;
+			}
+
+			/* Idle, re-arm interrupts and recheck so a message
+			 * that raced with the enable is not missed.
+			 */
+			adapter->ops->enable_interrupts(adapter);
+			crq = crq_queue_next_crq(queue);
+			if (!crq) {
+				more = false;
+				break;
+			}
+
+			adapter->ops->disable_interrupts(adapter);
+		}
+
+		ibmvsm_handle_crq(crq, adapter);
+		crq_queue_release_crq(crq);
+		done++;
+
+		/* CRQ reset was requested, stop processing CRQs.
+		 * Interrupts will be re-enabled by the reset task.
+		 */
+		if (adapter->state == ibmvsm_state_sched_reset) {
+			more = false;
+			break;
+		}
+	}
+
+	ibmvsm_adapter_stat_add(adapter, IBMVSM_STAT_CRQ_ENTRIES, done);
+
+	/* If the budget was exhausted, interrupts stay off and the caller
+	 * polls again later
+	 */
+	return more;
+}
+
+static void ibmvsm_task(unsigned long data)
+{
+	struct crq_server_adapter *adapter =
+		(struct crq_server_adapter *)data;
+
+	if (ibmvsm_process_crq(adapter))
+		tasklet_schedule(&adapter->work_task);
+}
+
+static void ibmvsm_crq_work(struct work_struct *work)
+{
+	struct crq_server_adapter *adapter =
+		container_of(work, struct crq_server_adapter, crq_work);
+
+	if (ibmvsm_process_crq(adapter))
+		queue_work(ibmvsm_crq_wq, &adapter->crq_work);
+}
+
+/**
+ * ibmvsm_init_crq_queue - Init CRQ Queue
+ *
+ * @adapter:	crq_server_adapter struct
  *
  * Return:
  *	0 - Success
- *	Non-Zero - Failure
+ *	Non-zero - Failure
  */
-static int ibmvsm_reset_crq_queue(struct crq_server_adapter *adapter)
+static int ibmvsm_init_crq_queue(struct crq_server_adapter *adapter)
 {
-	struct vio_dev *vdev = to_vio_dev(adapter->dev);
 	struct crq_queue *queue = &adapter->queue;
+	unsigned int order;
 	int rc = 0;
 
-	/* Close the CRQ */
-	h_free_crq(vdev->unit_address);
+	/* The queue must be physically contiguous. Fall back to a smaller
+	 * queue rather than failing the probe if memory is fragmented.
+	 */
+	order = get_order(clamp_t(size_t, crq_depth * sizeof(*queue->msgs),
+				  sizeof(*queue->msgs), IBMVSM_CRQ_MAX_BYTES));
+	for (;;) {
+		queue->msgs = (struct ibmvsm_crq_msg *)
+			__get_free_pages(GFP_KERNEL | __GFP_ZERO |
+					 (order ? __GFP_NOWARN : 0), order);
+		if (queue->msgs || !order)
+			break;
+		order--;
+	}
 
-	/* Clean out the queue */
-	memset(queue->msgs, 0x00, PAGE_SIZE);
-	queue->cur = 0;
+	if (!queue->msgs)
+		goto malloc_failed;
 
-	/* And re-open it again */
-	rc = h_reg_crq(vdev->unit_address,
-		       queue->msg_token, PAGE_SIZE);
-	if (rc == 2)
-		/* Adapter is good, but other end is not ready */
+	queue->order = order;
+	queue->size = (PAGE_SIZE << order) / sizeof(*queue->msgs);
+	queue->full = 0;
+	if (queue->size < crq_depth)
+		dev_warn(adapter->dev, "CRQ limited to %d entries\n",
+			 queue->size);
+
+	queue->msg_token = dma_map_single(adapter->dev, queue->msgs,
+					  queue->size * sizeof(*queue->msgs),
+					  DMA_BIDIRECTIONAL);
+
+	if (dma_mapping_error(adapter->dev, queue->msg_token))
+		goto map_failed;
+
+	spin_lock_init(&queue->lock);
+	rc = h_reg_crq(adapter);
+
+	if (rc == H_RESOURCE)
+		rc = ibmvsm_reset_crq_queue(adapter);
+
+	if (rc == 2) {
 		dev_warn(adapter->dev, "Partner adapter not ready\n");
-	else if (rc != 0)
-		dev_err(adapter->dev, "couldn't register crq--rc 0x%x\n", rc);
+		rc = 0;
+	} else if (rc != 0) {
+		dev_err(adapter->dev, "Error %d opening adapter\n", rc);
+		goto reg_crq_failed;
+	}
+
+	queue->cur = 0;
+
+	tasklet_init(&adapter->work_task, ibmvsm_task, (unsigned long)adapter);
+	INIT_WORK(&adapter->crq_work, ibmvsm_crq_work);
+	hrtimer_init(&adapter->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	adapter->poll_timer.function = ibmvsm_poll_timer;
+
+	if (adapter->ops->request_irq(adapter, ibmvsm_handle_event) != 0) {
+		dev_err(adapter->dev, "couldn't register irq\n");
+		goto req_irq_failed;
+	}
+
+	rc = adapter->ops->enable_interrupts(adapter);
+	if (rc != 0) {
+		dev_err(adapter->dev, "Error %d enabling interrupts!!!\n", rc);
+		goto req_irq_failed;
+	}
+
+	return rc;
+
+req_irq_failed:
+	/* Cannot have any work since we either never got our IRQ registered,
+	 * or never got interrupts enabled
+	 */
+	tasklet_kill(&adapter->work_task);
+	cancel_work_sync(&adapter->crq_work);
+	h_free_crq(adapter);
+reg_crq_failed:
+	dma_unmap_single(adapter->dev,
+			 queue->msg_token,
+			 queue->size * sizeof(*queue->msgs), DMA_BIDIRECTIONAL);
+map_failed:
+	free_pages((unsigned long)queue->msgs, queue->order);
+malloc_failed:
+	return -ENOMEM;
+}
+
+/**
+ * ibmvsm_release_crq_queue - Release CRQ Queue
+ *
+ * @adapter:	crq_server_adapter struct
+ */
+static void ibmvsm_release_crq_queue(struct crq_server_adapter *adapter)
+{
+	struct crq_queue *queue = &adapter->queue;
+	long rc;
+
+	/* Stop delivery first: no interrupt, and the poll timer and the
+	 * reset, resume and version work can no longer start a pass.
+	 */
+	adapter->ops->free_irq(adapter);
+	WRITE_ONCE(adapter->crq_stopped, true);
+	WRITE_ONCE(adapter->polling, false);
+
+	/* Then wait out the pass in flight, which may still queue the work */
+	tasklet_kill(&adapter->work_task);
+	cancel_work_sync(&adapter->crq_work);
+	hrtimer_cancel(&adapter->poll_timer);
+	cancel_work_sync(&adapter->reset_work);
+	cancel_work_sync(&adapter->resume_work);
+	cancel_delayed_work_sync(&adapter->version_work);
+
+	do {
+		rc = h_free_crq(adapter);
+	} while (rc == H_BUSY || H_IS_LONG_BUSY(rc));
+
+	dma_unmap_single(adapter->dev, queue->msg_token,
+			 queue->size * sizeof(*queue->msgs), DMA_BIDIRECTIONAL);
+	free_pages((unsigned long)queue->msgs, queue->order);
+}
+
+/**
+ * ibmvsm_close_vterms - Close all open vterms
+ *
+ * @adapter:	crq_server_adapter struct
+ *
+ * Marks the adapter failed so no new vterms are opened, then closes every
+ * open vterm and detaches it from its file session, so later file
+ * operations on that session fail with -EIO.
+ */
+static void ibmvsm_close_vterms(struct crq_server_adapter *adapter)
+{
+	struct ibmvsm_vterm *vterm;
+	int i;
+
+	mutex_lock(&adapter->vterm_mutex);
+	adapter->state = ibmvsm_state_failed;
+	for (i = 0; i < adapter->nr_vterms; i++) {
+		vterm = adapter->vterms[i];
+		if (vterm->state == ibmvterm_state_free ||
+		    vterm->state == ibmvterm_state_failed)
+			continue;
+
+		ibmvsm_vterm_orphan(vterm);
+		ibmvsm_vterm_close(vterm);
+	}
+	mutex_unlock(&adapter->vterm_mutex);
+}
+
+/**
+ * ibmvsm_free_vterms - Free the vterm table
+ *
+ * @adapter:	crq_server_adapter struct
+ *
+ * All vterms must be closed. Copes with a partially allocated table.
+ */
+static void ibmvsm_free_vterms(struct crq_server_adapter *adapter)
+{
+	int i;
+
+	for (i = 0; i < adapter->nr_vterms; i++) {
+		if (adapter->vterms[i])
+			kmem_cache_free(ibmvsm_vterm_cache, adapter->vterms[i]);
+	}
+
+	kfree(adapter->rx_pending);
+	kfree(adapter->vterms);
+	adapter->rx_pending = NULL;
+	adapter->vterms = NULL;
+	adapter->nr_vterms = 0;
+}
+
+/**
+ * ibmvsm_alloc_vterms - Allocate the vterm table
+ *
+ * @adapter:	crq_server_adapter struct
+ * @nr_vterms:	number of vterms the adapter can have open at once
+ *
+ * Each vterm is allocated separately from a cache line aligned slab so
+ * per-vterm locks do not share cache lines.
+ *
+ * Return:
+ *	0 - Success
+ *	Non-zero - Failure
+ */
+static int ibmvsm_alloc_vterms(struct crq_server_adapter *adapter,
+			       unsigned int nr_vterms)
+{
+	struct ibmvsm_vterm *vterm;
+	int i;
+
+	INIT_LIST_HEAD(&adapter->free_vterms);
+	hash_init(adapter->vterm_hash);
+	hash_init(adapter->open_hash);
+	hash_init(adapter->detached_hash);
+
+	adapter->vterms = kcalloc(nr_vterms, sizeof(*adapter->vterms),
+				  GFP_KERNEL);
+	adapter->rx_pending = kcalloc(BITS_TO_LONGS(nr_vterms),
+				      sizeof(unsigned long), GFP_KERNEL);
+	if (!adapter->vterms || !adapter->rx_pending)
+		goto alloc_failed;
+
+	adapter->nr_vterms = nr_vterms;
+	for (i = 0; i < nr_vterms; i++) {
+		vterm = kmem_cache_zalloc(ibmvsm_vterm_cache, GFP_KERNEL);
+		if (!vterm)
+			goto alloc_failed;
+
+		vterm->index = i;
+		vterm->adapter = adapter;
+		vterm->state = ibmvterm_state_free;
+		spin_lock_init(&vterm->lock);
+		mutex_init(&vterm->rx_lock);
+		init_waitqueue_head(&vterm->rx_wait);
+		mutex_init(&vterm->tx_lock);
+		init_waitqueue_head(&vterm->tx_wait);
+		INIT_DELAYED_WORK(&vterm->tx_work, ibmvsm_tx_backoff_work);
+		INIT_LIST_HEAD(&vterm->tx_node);
+		vterm->tx_weight = 1;
+		vterm->tx_class = IBMVSM_TX_BULK;
+		INIT_LIST_HEAD(&vterm->observers);
+		init_waitqueue_head(&vterm->obs_wait);
+		mutex_init(&vterm->obs_lock);
+		list_add_tail(&vterm->free_list, &adapter->free_vterms);
+		adapter->vterms[i] = vterm;
+	}
+
+	return 0;
+
+alloc_failed:
+	ibmvsm_free_vterms(adapter);
+	return -ENOMEM;
+}
+
+static ssize_t vterm_busy_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct crq_server_adapter *adapter = dev_get_drvdata(dev);
+	struct ibmvsm_vterm *vterm;
+	int i, len = 0;
+
+	for (i = 0; i < adapter->nr_vterms; i++) {
+		vterm = adapter->vterms[i];
+		if (!ibmvsm_vterm_alive(vterm))
+			continue;
+
+		len += scnprintf(buf + len, PAGE_SIZE - len, "0x%llx %llu\n",
+				 vterm->console_token, vterm->tx_busy);
+	}
+
+	return len;
+}
+static DEVICE_ATTR_RO(vterm_busy);
+
+static ssize_t crq_depth_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct crq_server_adapter *adapter = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", adapter->queue.size);
+}
+static DEVICE_ATTR_RO(crq_depth);
+
+static ssize_t crq_full_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct crq_server_adapter *adapter = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%llu\n",
+			 READ_ONCE(adapter->queue.full));
+}
+static DEVICE_ATTR_RO(crq_full);
+
+static ssize_t protocol_version_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct crq_server_adapter *adapter = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(adapter->version));
+}
+static DEVICE_ATTR_RO(protocol_version);
+
+static ssize_t max_chars_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct crq_server_adapter *adapter = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(adapter->max_chars));
+}
+static DEVICE_ATTR_RO(max_chars);
+
+static ssize_t max_open_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct crq_server_adapter *adapter = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(adapter->max_open));
+}
+static DEVICE_ATTR_RO(max_open);
+
+static ssize_t nr_open_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct crq_server_adapter *adapter = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(adapter->nr_open));
+}
+static DEVICE_ATTR_RO(nr_open);
+
+static struct attribute *ibmvsm_attrs[] = {
+	&dev_attr_vterm_busy.attr,
+	&dev_attr_crq_depth.attr,
+	&dev_attr_crq_full.attr,
+	&dev_attr_protocol_version.attr,
+	&dev_attr_max_chars.attr,
+	&dev_attr_max_open.attr,
+	&dev_attr_nr_open.attr,
+	NULL,
+};
+
+static const struct attribute_group ibmvsm_attr_group = {
+	.attrs = ibmvsm_attrs,
+};
+
+static const char * const ibmvsm_stat_names[IBMVSM_STAT_NR] = {
+	[IBMVSM_STAT_RX_BYTES]		= "rx_bytes",
+	[IBMVSM_STAT_TX_BYTES]		= "tx_bytes",
+	[IBMVSM_STAT_GET_CHARS]		= "get_chars_hcalls",
+	[IBMVSM_STAT_PUT_CHARS]		= "put_chars_hcalls",
+	[IBMVSM_STAT_PUT_CHARS_BUSY]	= "put_chars_busy",
+	[IBMVSM_STAT_OPEN_VTERM]	= "open_vterm_hcalls",
+	[IBMVSM_STAT_CLOSE_VTERM]	= "close_vterm_hcalls",
+	[IBMVSM_STAT_RX_RING_FULL]	= "rx_ring_full",
+	[IBMVSM_STAT_TX_RING_FULL]	= "tx_ring_full",
+	[IBMVSM_STAT_RX_OBS_DROPPED]	= "rx_observer_dropped",
+	[IBMVSM_STAT_CRQ_ENTRIES]	= "crq_entries",
+	[IBMVSM_STAT_CRQ_PASSES]	= "crq_passes",
+	[IBMVSM_STAT_CRQ_IRQS]		= "crq_irqs",
+	[IBMVSM_STAT_CRQ_POLLS]		= "crq_polls",
+	[IBMVSM_STAT_CRQ_COALESCE]	= "crq_coalesce",
+};
+
+static const char * const ibmvsm_lat_names[IBMVSM_LAT_NR] = {
+	[IBMVSM_LAT_GET_CHARS]	= "get_chars_latency_ns",
+	[IBMVSM_LAT_PUT_CHARS]	= "put_chars_latency_ns",
+};
+
+/**
+ * ibmvsm_stats_show - Print a set of per-CPU statistics
+ *
+ * @m:		seq_file to print to
+ * @stats:	per-CPU statistics to sum up
+ *
+ * Prints one "name value" line per counter, followed by each latency
+ * histogram as "low-high count" lines for its non-empty buckets.
+ */
+static void ibmvsm_stats_show(struct seq_file *m,
+			      struct ibmvsm_stats __percpu *stats)
+{
+	u64 sum;
+	int cpu, i, j;
+
+	for (i = 0; i < IBMVSM_STAT_NR; i++) {
+		sum = 0;
+		for_each_possible_cpu(cpu)
+			sum += per_cpu_ptr(stats, cpu)->count[i];
+		seq_printf(m, "%s %llu\n", ibmvsm_stat_names[i], sum);
+	}
+
+	for (i = 0; i < IBMVSM_LAT_NR; i++) {
+		seq_printf(m, "%s\n", ibmvsm_lat_names[i]);
+		for (j = 0; j < IBMVSM_LAT_BUCKETS; j++) {
+			sum = 0;
+			for_each_possible_cpu(cpu)
+				sum += per_cpu_ptr(stats, cpu)->lat[i][j];
+			if (sum)
+				seq_printf(m, "  %llu-%llu %llu\n",
+					   j ? 1ULL << j : 0, (2ULL << j) - 1,
+					   sum);
+		}
+	}
+}
+
+static int ibmvsm_adapter_stats_show(struct seq_file *m, void *v)
+{
+	struct crq_server_adapter *adapter = m->private;
+
+	ibmvsm_stats_show(m, adapter->stats);
+	seq_printf(m, "crq_full %llu\n", READ_ONCE(adapter->queue.full));
+	seq_printf(m, "crq_resets %u\n", READ_ONCE(adapter->resets));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ibmvsm_adapter_stats);
+
+static int ibmvsm_vterm_stats_show(struct seq_file *m, void *v)
+{
+	struct crq_server_adapter *adapter = m->private;
+	struct ibmvsm_vterm *vterm;
+	int i;
 
-	return rc;
+	/* Stats are only allocated while a vterm is open */
+	mutex_lock(&adapter->vterm_mutex);
+	for (i = 0; i < adapter->nr_vterms; i++) {
+		vterm = adapter->vterms[i];
+		if (!ibmvsm_vterm_alive(vterm))
+			continue;
+
+		seq_printf(m, "vterm %u token 0x%llx%s\n", vterm->index,
+			   vterm->console_token,
+			   vterm->detached ? " detached" : "");
+		ibmvsm_stats_show(m, vterm->stats);
+		seq_putc(m, '\n');
+	}
+	mutex_unlock(&adapter->vterm_mutex);
+
+	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(ibmvsm_vterm_stats);
 
 /**
- * ibmvsm_crq_process - Process CRQ
- *
- * @adapter:    crq_server_adapter struct
- * @crq:	ibmvsm_crq_msg struct
+ * ibmvsm_debugfs_init - Create an adapter's debugfs files
  *
- * Process the CRQ message based upon the type of message received.
+ * @adapter:	crq_server_adapter struct
  *
+ * Creates debugfs/ibmvsm/<adapter>/ holding "stats" for the adapter as a
+ * whole and "vterms" for each open vterm. Failures are not fatal.
  */
-static void ibmvsm_crq_process(struct crq_server_adapter *adapter,
-			       struct ibmvsm_crq_msg *crq)
+static void ibmvsm_debugfs_init(struct crq_server_adapter *adapter)
 {
-	switch (crq->type) {
-	case VSM_MSG_VER_EXCH:
-	case VSM_MSG_VTERM_INT:
-	case VSM_MSG_VERSION_EXCH_RSP:
-	case VSM_MSG_SIG_VTERM_INT:
-	case VSM_MSG_ERR:
-		dev_warn(adapter->dev, "CRQ recv: unexpected msg (0x%x)\n",
-			 crq->type);
-		break;
-	default:
-		dev_warn(adapter->dev, "CRQ recv: unknown msg (0x%x)\n",
-			 crq->type);
-		break;
+	if (!ibmvsm_debugfs_root)
+		return;
+
+	adapter->debugfs = debugfs_create_dir(adapter->name,
+					      ibmvsm_debugfs_root);
+	if (IS_ERR_OR_NULL(adapter->debugfs)) {
+		adapter->debugfs = NULL;
+		return;
 	}
+
+	debugfs_create_file("stats", 0444, adapter->debugfs, adapter,
+			    &ibmvsm_adapter_stats_fops);
+	debugfs_create_file("vterms", 0444, adapter->debugfs, adapter,
+			    &ibmvsm_vterm_stats_fops);
 }
 
 /**
- * ibmvsm_reset - Reset
+ * ibmvsm_adapter_release - Free an adapter
  *
- * @adapter:	crq_server_adapter struct
- * @xport_event:	export_event field
+ * @kref:	kref embedded in the crq_server_adapter
  *
- * Closes all vterm sessions and conditionally schedules a CRQ reset.
- * @xport_event: If true, the partner closed their CRQ; we don't need to reset.
- *               If false, we need to schedule a CRQ reset.
+ * Called once the adapter is removed and its last file session is closed.
+ * Only then is the reference on the device taken by ibmvsm_add_adapter()
+ * dropped, so a session outliving the removal can still log against it.
  */
-static void ibmvsm_reset(struct crq_server_adapter *adapter, bool xport_event)
+static void ibmvsm_adapter_release(struct kref *kref)
 {
-	return 0;
+	struct crq_server_adapter *adapter =
+		container_of(kref, struct crq_server_adapter, kref);
+
+	ibmvsm_free_vterms(adapter);
+	free_percpu(adapter->stats);
+	put_device(adapter->dev);
+	ida_simple_remove(&ibmvsm_ida, adapter->index);
+	kfree(adapter);
 }
 
 /**
- * ibmvsm_handle_crq_init - Handle CRQ Init
+ * ibmvsm_add_adapter - Bring up an adapter
  *
- * @crq:	ibmvsm_crq_msg struct
- * @adapter:	crq_server_adapter struct
+ * @dev:	device the adapter is bound to
+ * @ops:	hypervisor backend
+ * @backend:	backend private data, available as adapter->backend
  *
- * Handle the type of crq initialization based on whether
- * it is a message or a response.
+ * Registers the CRQ, starts the initialization handshake and creates the
+ * adapter's misc device. The adapter is stored as @dev's driver data.
  *
+ * Return:
+ *	0 - Success
+ *	Non-zero - Failure
  */
-static void ibmvsm_handle_crq_init(struct ibmvsm_crq_msg *crq,
-				   struct crq_server_adapter *adapter)
+int ibmvsm_add_adapter(struct device *dev, const struct ibmvsm_hcall_ops *ops,
+		       void *backend)
 {
-	switch (crq->type) {
-	case 0x01:	/* Initialization message */
-		dev_dbg(adapter->dev, "CRQ recv: CRQ init msg - state 0x%x\n",
-			ibmvsm.state);
-		if (ibmvsm.state == ibmvsm_state_crqinit) {
-			if (ibmvsm_send_init_msg(adapter, CRQ_INIT_COMPLETE) == 0) {
-				/* Do Version Exchange */
-			} else {
-				dev_err(adapter->dev, " Unable to send init rsp\n");
-			}
-		} else {
-			dev_err(adapter->dev, "Invalid state 0x%x\n",
-				ibmvsm.state);
+	struct crq_server_adapter *adapter;
+	int i, rc;
+
+	dev_set_drvdata(dev, NULL);
+	adapter = kzalloc(sizeof(*adapter), GFP_KERNEL);
+	if (!adapter)
+		return -ENOMEM;
+
+	adapter->index = ida_simple_get(&ibmvsm_ida, 0, 0, GFP_KERNEL);
+	if (adapter->index < 0) {
+		rc = adapter->index;
+		kfree(adapter);
+		return rc;
+	}
+
+	kref_init(&adapter->kref);
+	mutex_init(&adapter->vterm_mutex);
+	INIT_WORK(&adapter->reset_work, ibmvsm_reset_task);
+	INIT_WORK(&adapter->resume_work, ibmvsm_resume_task);
+	INIT_DELAYED_WORK(&adapter->version_work, ibmvsm_version_timeout);
+	INIT_WORK(&adapter->tx_work, ibmvsm_tx_sched_work);
+	mutex_init(&adapter->tx_mutex);
+	spin_lock_init(&adapter->tx_sched_lock);
+	for (i = 0; i < IBMVSM_TX_CLASSES; i++)
+		INIT_LIST_HEAD(&adapter->tx_active[i]);
+	adapter->stats = alloc_percpu(struct ibmvsm_stats);
+	if (!adapter->stats) {
+		rc = -ENOMEM;
+		goto put_adapter;
+	}
+
+	adapter->dev = get_device(dev);
+	adapter->ops = ops;
+	adapter->backend = backend;
+	adapter->state = ibmvsm_state_initial;
+
+	/* The first adapter keeps the historical /dev/ibmvsm name */
+	if (adapter->index)
+		snprintf(adapter->name, sizeof(adapter->name), "%s%d",
+			 ibmvsm_driver_name, adapter->index);
+	else
+		snprintf(adapter->name, sizeof(adapter->name), "%s",
+			 ibmvsm_driver_name);
+
+	/* Spread adapter interrupts, and with them CRQ processing, across
+	 * CPUs close to the device
+	 */
+	adapter->cpu = cpumask_local_spread(adapter->index,
+					    dev_to_node(adapter->dev));
+
+	if (ops->probe) {
+		rc = ops->probe(adapter);
+		if (rc) {
+			adapter->state = ibmvsm_state_failed;
+			goto put_adapter;
 		}
+	}
 
-		break;
-	case 0x02:	/* Initialization response */
-		dev_dbg(adapter->dev, "CRQ recv: initialization resp msg - state 0x%x\n",
-			ibmvsm.state);
-		if (ibmvsm.state == ibmvsm_state_crqinit)
-			/* Do Version Exchange */
-		break;
-	default:
-		dev_warn(adapter->dev, "Unknown crq message type 0x%lx\n",
-			 (unsigned long)crq->type);
+	rc = ibmvsm_alloc_vterms(adapter, max_vterms);
+	if (rc) {
+		dev_err(adapter->dev, "Error allocating %u vterms\n",
+			max_vterms);
+		adapter->state = ibmvsm_state_failed;
+		goto put_adapter;
+	}
+
+	/* Until the version exchange says otherwise */
+	adapter->max_chars = min_t(u32, IBMVSM_DEFAULT_CHARS,
+				   ibmvsm_local_max_chars(adapter));
+	adapter->max_open = adapter->nr_vterms;
+
+	/* Init CRQ */
+	rc = ibmvsm_init_crq_queue(adapter);
+	if (rc != 0 && rc != H_RESOURCE) {
+		dev_err(adapter->dev, "Error initializing CRQ.  rc = 0x%x\n",
+			rc);
+		adapter->state = ibmvsm_state_failed;
+		rc = -EPERM;
+		goto put_adapter;
+	}
+
+	adapter->state = ibmvsm_state_crqinit;
+
+	if (ibmvsm_send_init_msg(adapter, CRQ_INIT) != 0 &&
+	    rc != H_RESOURCE)
+		dev_warn(adapter->dev, "Failed to send initialize CRQ message\n");
+
+	dev_set_drvdata(dev, adapter);
+
+	if (sysfs_create_group(&dev->kobj, &ibmvsm_attr_group))
+		dev_warn(adapter->dev, "Failed to create sysfs attributes\n");
+
+	ibmvsm_debugfs_init(adapter);
+
+	adapter->miscdev.minor = MISC_DYNAMIC_MINOR;
+	adapter->miscdev.name = adapter->name;
+	adapter->miscdev.fops = &ibmvsm_fops;
+	adapter->miscdev.parent = adapter->dev;
+	rc = misc_register(&adapter->miscdev);
+	if (rc) {
+		dev_err(adapter->dev, "misc registration failed\n");
+		goto misc_failed;
 	}
+
+	dev_info(adapter->dev, "node %d:%d\n", MISC_MAJOR,
+		 adapter->miscdev.minor);
+
 	return 0;
+
+misc_failed:
+	debugfs_remove_recursive(adapter->debugfs);
+	sysfs_remove_group(&dev->kobj, &ibmvsm_attr_group);
+	dev_set_drvdata(dev, NULL);
+	ibmvsm_release_crq_queue(adapter);
+put_adapter:
+	kref_put(&adapter->kref, ibmvsm_adapter_release);
+	return rc;
 }
+EXPORT_SYMBOL_GPL(ibmvsm_add_adapter);
 
 /**
- * ibmvsm_handle_crq - Handle CRQ
+ * ibmvsm_remove_adapter - Tear down an adapter
  *
- * @crq:	ibmvsm_crq_msg struct
  * @adapter:	crq_server_adapter struct
  *
- * Read the command elements from the command queue and execute the
- * requests based upon the type of crq message.
- *
+ * Closes all vterms and releases the CRQ. The backend is not called
+ * again once this returns.
  */
-static void ibmvsm_handle_crq(struct ibmvsm_crq_msg *crq,
-			      struct crq_server_adapter *adapter)
+void ibmvsm_remove_adapter(struct crq_server_adapter *adapter)
 {
-	switch (crq->valid) {
-	case 0xC0:		/* initialization */
-		ibmvsm_handle_crq_init(crq, adapter);
-		break;
-	case 0xFF:	/* Hypervisor telling us the connection is closed */
-		dev_warn(adapter->dev, "CRQ recv: virtual adapter failed - resetting.\n");
-		ibmvsm_reset(adapter, true);
-		break;
-	case 0x80:	/* real payload */
-		ibmvsm_crq_process(adapter, crq);
-		break;
-	default:
-		dev_warn(adapter->dev, "CRQ recv: unknown msg 0x%02x.\n",
-			 crq->valid);
-		break;
-	}
+	struct device *dev = adapter->dev;
+
+	/* No new file sessions after this */
+	misc_deregister(&adapter->miscdev);
+	debugfs_remove_recursive(adapter->debugfs);
+
+	ibmvsm_close_vterms(adapter);
+	cancel_work_sync(&adapter->tx_work);
+	sysfs_remove_group(&dev->kobj, &ibmvsm_attr_group);
+	ibmvsm_release_crq_queue(adapter);
+	dev_set_drvdata(dev, NULL);
+
+	/* Open sessions keep the adapter around until they are closed */
+	kref_put(&adapter->kref, ibmvsm_adapter_release);
 }
+EXPORT_SYMBOL_GPL(ibmvsm_remove_adapter);
 
-static void ibmvsm_task(unsigned long data)
+#ifdef CONFIG_PPC_PSERIES
+/* pseries backend, making the real hcalls */
+
+static long ibmvsm_plpar_reg_crq(struct crq_server_adapter *adapter)
 {
-	struct crq_server_adapter *adapter =
-		(struct crq_server_adapter *)data;
-	struct vio_dev *vdev = to_vio_dev(adapter->dev);
-	struct ibmvsm_crq_msg *crq;
-	int done = 0;
-
-	while (!done) {
-		/* Pull all the valid messages off the CRQ */
-		while ((crq = crq_queue_next_crq(&adapter->queue)) != NULL) {
-			ibmvsm_handle_crq(crq, adapter);
-			crq->valid = 0x00;
-			/* CRQ reset was requested, stop processing CRQs.
-			 * Interrupts will be re-enabled by the reset task.
-			 */
-			if (ibmvsm.state == ibmvsm_state_sched_reset)
-				return;
-		}
-
-		vio_enable_interrupts(vdev);
-		crq = crq_queue_next_crq(&adapter->queue);
-		if (crq) {
-			vio_disable_interrupts(vdev);
-			ibmvsm_handle_crq(crq, adapter);
-			crq->valid = 0x00;
-			/* CRQ reset was requested, stop processing CRQs.
-			 * Interrupts will be re-enabled by the reset task.
-			 */
-			if (ibmvsm.state == ibmvsm_state_sched_reset)
-				return;
-		} else {
-			done = 1;
-		}
-	}
+	struct crq_queue *queue = &adapter->queue;
+
+	return plpar_hcall_norets(H_REG_CRQ,
+				  to_vio_dev(adapter->dev)->unit_address,
+				  queue->msg_token, PAGE_SIZE << queue->order);
 }
 
-/**
- * ibmvsm_init_crq_queue - Init CRQ Queue
- *
- * @adapter:	crq_server_adapter struct
- *
- * Return:
- *	0 - Success
- *	Non-zero - Failure
- */
-static int ibmvsm_init_crq_queue(struct crq_server_adapter *adapter)
+static long ibmvsm_plpar_free_crq(struct crq_server_adapter *adapter)
 {
-	struct vio_dev *vdev = to_vio_dev(adapter->dev);
-	struct crq_queue *queue = &adapter->queue;
-	int rc = 0;
-	int retrc = 0;
+	return plpar_hcall_norets(H_FREE_CRQ,
+				  to_vio_dev(adapter->dev)->unit_address);
+}
 
-	queue->msgs = (struct ibmvsm_crq_msg *)get_zeroed_page(GFP_KERNEL);
+static long ibmvsm_plpar_send_crq(struct crq_server_adapter *adapter,
+				  u64 word1, u64 word2)
+{
+	return plpar_hcall_norets(H_SEND_CRQ,
+				  to_vio_dev(adapter->dev)->unit_address,
+				  word1, word2);
+}
 
-	if (!queue->msgs)
-		goto malloc_failed;
+static long ibmvsm_plpar_open_vterm(struct crq_server_adapter *adapter,
+				    u32 session_id, u32 partition_id,
+				    u64 *token)
+{
+	unsigned long retbuf[PLPAR_HCALL_BUFSIZE];
+	long rc;
 
-	queue->size = PAGE_SIZE / sizeof(*queue->msgs);
+	rc = plpar_hcall(H_OPEN_VTERM_LP, retbuf,
+			 to_vio_dev(adapter->dev)->unit_address,
+			 session_id, partition_id);
+	*token = retbuf[0];
 
-	queue->msg_token = dma_map_single(adapter->dev, queue->msgs,
-					  queue->size * sizeof(*queue->msgs),
-					  DMA_BIDIRECTIONAL);
+	return rc;
+}
 
-	if (dma_mapping_error(adapter->dev, queue->msg_token))
-		goto map_failed;
+static long ibmvsm_plpar_close_vterm(struct crq_server_adapter *adapter,
+				     u64 token)
+{
+	return plpar_hcall_norets(H_CLOSE_VTERM_LP,
+				  to_vio_dev(adapter->dev)->unit_address,
+				  token);
+}
 
-	retrc = plpar_hcall_norets(H_REG_CRQ,
-				   vdev->unit_address,
-				   queue->msg_token, PAGE_SIZE);
-	retrc = rc;
+static long ibmvsm_plpar_get_term_char(struct crq_server_adapter *adapter,
+				       u64 token, char *buf,
+				       unsigned long *len)
+{
+	unsigned long retbuf[PLPAR_HCALL_BUFSIZE];
+	unsigned long *lbuf = (unsigned long *)buf;
+	long rc;
 
-	if (rc == H_RESOURCE)
-		rc = ibmvsm_reset_crq_queue(adapter);
+	rc = plpar_hcall(H_GET_TERM_CHAR_LP, retbuf,
+			 to_vio_dev(adapter->dev)->unit_address, token);
+	lbuf[MSG_HI] = be64_to_cpu(retbuf[1]);
+	lbuf[MSG_LOW] = be64_to_cpu(retbuf[2]);
+	*len = retbuf[0];
 
-	if (rc == 2) {
-		dev_warn(adapter->dev, "Partner adapter not ready\n");
-		retrc = 0;
-	} else if (rc != 0) {
-		dev_err(adapter->dev, "Error %d opening adapter\n", rc);
-		goto reg_crq_failed;
-	}
+	return rc;
+}
 
-	queue->cur = 0;
-	spin_lock_init(&queue->lock);
+static long ibmvsm_plpar_put_term_char(struct crq_server_adapter *adapter,
+				       u64 token, const char *buf,
+				       unsigned long len)
+{
+	const unsigned long *lbuf = (const unsigned long *)buf;
 
-	tasklet_init(&adapter->work_task, ibmvsm_task, (unsigned long)adapter);
+	return plpar_hcall_norets(H_PUT_TERM_CHAR_LP,
+				  to_vio_dev(adapter->dev)->unit_address,
+				  token, len, cpu_to_be64(lbuf[MSG_HI]),
+				  cpu_to_be64(lbuf[MSG_LOW]));
+}
 
-	if (request_irq(vdev->irq,
-			ibmvsm_handle_event,
-			0, "ibmvsm", (void *)adapter) != 0) {
-		dev_err(adapter->dev, "couldn't register irq 0x%x\n",
-			vdev->irq);
-		goto req_irq_failed;
-	}
+static int ibmvsm_plpar_request_irq(struct crq_server_adapter *adapter,
+				    irq_handler_t handler)
+{
+	struct vio_dev *vdev = to_vio_dev(adapter->dev);
+	int rc;
 
-	rc = vio_enable_interrupts(vdev);
-	if (rc != 0) {
-		dev_err(adapter->dev, "Error %d enabling interrupts!!!\n", rc);
-		goto req_irq_failed;
-	}
+	rc = request_irq(vdev->irq, handler, 0, adapter->name,
+			 (void *)adapter);
+	if (rc)
+		return rc;
 
-	return retrc;
+	irq_set_affinity_hint(vdev->irq, cpumask_of(adapter->cpu));
 
-req_irq_failed:
-	/* Cannot have any work since we either never got our IRQ registered,
-	 * or never got interrupts enabled
-	 */
-	tasklet_kill(&adapter->work_task);
-	h_free_crq(vdev->unit_address);
-reg_crq_failed:
-	dma_unmap_single(adapter->dev,
-			 queue->msg_token,
-			 queue->size * sizeof(*queue->msgs), DMA_BIDIRECTIONAL);
-map_failed:
-	free_page((unsigned long)queue->msgs);
-malloc_failed:
-	return -ENOMEM;
+	return 0;
+}
+
+static void ibmvsm_plpar_free_irq(struct crq_server_adapter *adapter)
+{
+	struct vio_dev *vdev = to_vio_dev(adapter->dev);
+
+	irq_set_affinity_hint(vdev->irq, NULL);
+	free_irq(vdev->irq, (void *)adapter);
+}
+
+static int ibmvsm_plpar_enable_interrupts(struct crq_server_adapter *adapter)
+{
+	return vio_enable_interrupts(to_vio_dev(adapter->dev));
+}
+
+static int ibmvsm_plpar_disable_interrupts(struct crq_server_adapter *adapter)
+{
+	return vio_disable_interrupts(to_vio_dev(adapter->dev));
 }
 
 /* Fill in the liobn and riobn fields on the adapter */
@@ -661,47 +5277,40 @@ static int read_dma_window(struct vio_dev *vdev,
 	return 0;
 }
 
-static int ibmvsm_probe(struct vio_dev *vdev, const struct vio_device_id *id)
+static int ibmvsm_plpar_probe(struct crq_server_adapter *adapter)
 {
-	struct crq_server_adapter *adapter = &ibmvsm_adapter;
-	int rc;
-
-	dev_set_drvdata(&vdev->dev, NULL);
-	memset(adapter, 0, sizeof(*adapter));
-	adapter->dev = &vdev->dev;
-
-	dev_info(adapter->dev, "Probe for UA 0x%x\n", vdev->unit_address);
-
 	/* Read DMA Window */
-	rc = read_dma_window(vdev, adapter);
-	if (rc != 0) {
-		ibmvsm.state = ibmvsm_state_failed;
-		return -1;
-	}
+	if (read_dma_window(to_vio_dev(adapter->dev), adapter))
+		return -EINVAL;
 
 	dev_dbg(adapter->dev, "Probe: liobn 0x%x, riobn 0x%x\n",
 		adapter->liobn, adapter->riobn);
 
-	/* Init CRQ */
-	rc = ibmvsm_init_crq_queue(adapter);
-	if (rc != 0 && rc != H_RESOURCE) {
-		dev_err(adapter->dev, "Error initializing CRQ.  rc = 0x%x\n",
-			rc);
-		ibmvsm.state = ibmvsm_state_failed;
-		goto crq_failed;
-	}
-
-	ibmvsm.state = ibmvsm_state_crqinit;
+	return 0;
+}
 
-	if (ibmvsm_send_init_msg(adapter, CRQ_INIT) != 0 &&
-	    rc != H_RESOURCE)
-		dev_warn(adapter->dev, "Failed to send initialize CRQ message\n");
+static const struct ibmvsm_hcall_ops ibmvsm_plpar_ops = {
+	/* The data travels in two registers each way */
+	.max_chars		= 16,
+	.probe			= ibmvsm_plpar_probe,
+	.reg_crq		= ibmvsm_plpar_reg_crq,
+	.free_crq		= ibmvsm_plpar_free_crq,
+	.send_crq		= ibmvsm_plpar_send_crq,
+	.open_vterm		= ibmvsm_plpar_open_vterm,
+	.close_vterm		= ibmvsm_plpar_close_vterm,
+	.get_term_char		= ibmvsm_plpar_get_term_char,
+	.put_term_char		= ibmvsm_plpar_put_term_char,
+	.request_irq		= ibmvsm_plpar_request_irq,
+	.free_irq		= ibmvsm_plpar_free_irq,
+	.enable_interrupts	= ibmvsm_plpar_enable_interrupts,
+	.disable_interrupts	= ibmvsm_plpar_disable_interrupts,
+};
 
-	dev_set_drvdata(&vdev->dev, adapter);
+static int ibmvsm_probe(struct vio_dev *vdev, const struct vio_device_id *id)
+{
+	dev_info(&vdev->dev, "Probe for UA 0x%x\n", vdev->unit_address);
 
-	return 0;
-crq_failed:
-	return -EPERM;
+	return ibmvsm_add_adapter(&vdev->dev, &ibmvsm_plpar_ops, NULL);
 }
 
 static int ibmvsm_remove(struct vio_dev *vdev)
@@ -711,7 +5320,7 @@ static int ibmvsm_remove(struct vio_dev *vdev)
 	dev_info(adapter->dev, "Entering remove for UA 0x%x\n",
 		 vdev->unit_address);
 
-	/* Need to release the CRQ here */
+	ibmvsm_remove_adapter(adapter);
 
 	return 0;
 }
@@ -728,55 +5337,75 @@ static struct vio_driver ibmvsm_driver = {
 	.probe       = ibmvsm_probe,
 	.remove      = ibmvsm_remove,
 };
-
-static struct miscdevice ibmvsm_miscdev = {
-	.name = ibmvsm_driver_name,
-	.minor = MISC_DYNAMIC_MINOR,
-	.fops = &ibmvsm_fops,
-};
+#endif /* CONFIG_PPC_PSERIES */
 
 static int __init ibmvsm_module_init(void)
 {
-	int rc, i;
+	int rc;
 
-	ibmvsm.state = ibmvsm_state_initial;
 	pr_info("ibmvsm: version %s\n", IBMVSM_DRIVER_VERSION);
 
-	rc = misc_register(&ibmvsm_miscdev);
-	if (rc) {
-		pr_err("ibmvsm: misc registration failed\n");
-		goto misc_register_fail;
+	if (crq_mode > ibmvsm_crq_workqueue) {
+		pr_err("ibmvsm: invalid crq_mode %u\n", crq_mode);
+		return -EINVAL;
 	}
-	pr_info("ibmvsm: node %d:%d\n", MISC_MAJOR,
-		ibmvsm_miscdev.minor);
 
-	memset(vterms, 0, sizeof(struct ibmvsm_vterm) * MAX_VTERM);
-	for (i = 0; i < MAX_VTERM; i++) {
-		spin_lock_init(&vterms[i].lock);
-		vterms[i].state = ibmvterm_state_free;
+	ibmvsm_vterm_cache = kmem_cache_create("ibmvsm_vterm",
+					       sizeof(struct ibmvsm_vterm), 0,
+					       SLAB_HWCACHE_ALIGN, NULL);
+	if (!ibmvsm_vterm_cache)
+		return -ENOMEM;
+
+	if (crq_mode == ibmvsm_crq_workqueue) {
+		ibmvsm_crq_wq = alloc_workqueue("ibmvsm_crq", WQ_HIGHPRI, 0);
+		if (!ibmvsm_crq_wq) {
+			rc = -ENOMEM;
+			goto wq_fail;
+		}
 	}
 
+	/* Statistics are optional, carry on without debugfs */
+	ibmvsm_debugfs_root = debugfs_create_dir(ibmvsm_driver_name, NULL);
+	if (IS_ERR(ibmvsm_debugfs_root))
+		ibmvsm_debugfs_root = NULL;
+
+#ifdef CONFIG_PPC_PSERIES
 	rc = vio_register_driver(&ibmvsm_driver);
 	if (rc) {
 		pr_err("ibmvsm: rc %d from vio_register_driver\n", rc);
 		goto vio_reg_fail;
 	}
+#endif
 	/* Init data structures */
 	return 0;
 
+#ifdef CONFIG_PPC_PSERIES
 vio_reg_fail:
-	misc_deregister(&ibmvsm_miscdev);
-misc_register_fail:
+#endif
+	debugfs_remove_recursive(ibmvsm_debugfs_root);
+	if (ibmvsm_crq_wq)
+		destroy_workqueue(ibmvsm_crq_wq);
+wq_fail:
+	kmem_cache_destroy(ibmvsm_vterm_cache);
 	return rc;
 }
 
 static void __exit ibmvsm_module_exit(void)
 {
 	pr_info("ibmvsm: module exit\n");
+#ifdef CONFIG_PPC_PSERIES
 	vio_unregister_driver(&ibmvsm_driver);
-	misc_deregister(&ibmvsm_miscdev);
+#endif
+	debugfs_remove_recursive(ibmvsm_debugfs_root);
+	if (ibmvsm_crq_wq)
+		destroy_workqueue(ibmvsm_crq_wq);
+	kmem_cache_destroy(ibmvsm_vterm_cache);
+	ida_destroy(&ibmvsm_ida);
 }
 
+module_init(ibmvsm_module_init);
+module_exit(ibmvsm_module_exit);
+
 MODULE_AUTHOR("Bryant G. Ly <bryantly@linux.vnet.ibm.com>");
 MODULE_DESCRIPTION("IBM VSM");
 MODULE_VERSION(IBMVSM_DRIVER_VERSION);
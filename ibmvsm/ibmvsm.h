@@ -10,20 +10,71 @@
 #ifndef IBMVSM_H
 #define IBMVSM_H
 
+#include <linux/interrupt.h>
+#include <linux/hrtimer.h>
+#include <linux/hashtable.h>
+#include <linux/kref.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "ibmvsm_uapi.h"
+
+#ifdef CONFIG_PPC_PSERIES
+#include <asm/hvcall.h>
+#else
+/* Hypervisor return codes, as in asm/hvcall.h, for the simulated backend */
+#define H_SUCCESS			0
+#define H_BUSY				1
+#define H_CLOSED			2
+#define H_NOT_AVAILABLE			3
+#define H_PARAMETER			-4
+#define H_RESOURCE			-16
+#define H_NOT_FOUND			-61
+#define H_LONG_BUSY_ORDER_1_MSEC	9900
+#define H_LONG_BUSY_ORDER_100_SEC	9905
+#define H_IS_LONG_BUSY(x)  ((x >= H_LONG_BUSY_ORDER_1_MSEC) && \
+			    (x <= H_LONG_BUSY_ORDER_100_SEC))
+#endif
+
 #define H_OPEN_VTERM_LP		0x3D4
 #define H_GET_TERM_CHAR_LP	0x3D8
 #define H_PUT_TERM_CHAR_LP	0x3DC
 #define H_CLOSE_VTERM_LP	0x3E0
 
+/* VSM_IOCTL_SETID as first defined, sized by a pointer. Still accepted; on
+ * 64 bit it is the same number.
+ */
+#define VSM_IOCTL_SETID_OLD	_IOW(VSM_TYPE, 0x00, unsigned char *)
+
 #define VSM_MSG_VER_EXCH		0x01
 #define VSM_MSG_VTERM_INT		0x02
 #define VSM_MSG_ERR			0x03
 #define VSM_MSG_VERSION_EXCH_RSP	0x81
 #define VSM_MSG_SIG_VTERM_INT		0x82
 
-/* ioctl info */
-#define VSM_TYPE		0xCD
-#define VSM_IOCTL_SETID		_IOW(VSM_TYPE, 0x00, unsigned char *)
+/* Version exchange */
+#define IBMVSM_PROTOCOL_VERSION		1
+/* Bytes per get/put chars hcall without, and at most with, negotiation */
+#define IBMVSM_DEFAULT_CHARS		16
+#define IBMVSM_MAX_CHARS		64
+/* Wait for VSM_MSG_VERSION_EXCH_RSP before assuming a partner without it */
+#define IBMVSM_VERSION_TIMEOUT_MS	2000
+
+/* Receive and transmit ring sizes per vterm, must be powers of two */
+#define IBMVSM_RX_RING_SIZE	(64 * 1024)
+#define IBMVSM_TX_RING_SIZE	(16 * 1024)
+/* Get chars hcalls per receive batch made outside vterm->lock */
+#define IBMVSM_RX_BATCH		16
+
+/* CRQ sizing, in 16 byte entries and in bytes whatever the page size */
+#define IBMVSM_CRQ_DEFAULT_DEPTH	8192
+#define IBMVSM_CRQ_MAX_BYTES		(1024 * 1024)
+
+/* Receive history of all vterms of an adapter together */
+#define IBMVSM_HISTORY_ADAPTER_MAX_KB	(64 * 1024)
 
 enum ibmvsm_states {
 	ibmvsm_state_sched_reset  = -1,
@@ -47,8 +98,23 @@ enum ibmvsm_vterm_states {
 	/* HMC connection ready, open resp msg from HV */
 	ibmvterm_state_ready   = 3,
 
-	/* VTERM connection failure */
+	/* Closed underneath its session, freed once that session closes */
 	ibmvterm_state_failed  = 4,
+
+	/* CRQ reset in progress, reopened once the CRQ is back */
+	ibmvterm_state_suspended = 5,
+};
+
+enum crq_entry_header {
+	CRQ_FREE = 0x00,
+	CRQ_CMD_RSP = 0x80,
+	CRQ_INIT_MSG = 0xC0,
+	CRQ_XPORT_EVENT = 0xFF
+};
+
+enum crq_init_formats {
+	CRQ_INIT = 0x01,
+	CRQ_INIT_COMPLETE = 0x02
 };
 
 struct ibmvsm_crq_msg {
@@ -56,60 +122,295 @@ struct ibmvsm_crq_msg {
 	u8 type;		/* ibmvsm msg type */
 	u16 rsvd;
 	u32 rsvd1;
-	u64 console_token;	/* Console Token */
+	__be64 console_token;	/* Console Token */
+};
+
+/* VSM_MSG_VER_EXCH and VSM_MSG_VERSION_EXCH_RSP */
+struct ibmvsm_crq_version {
+	u8 valid;		/* CRQ_CMD_RSP */
+	u8 type;
+	__be16 version;		/* protocol version */
+	__be16 max_chars;	/* bytes per get/put chars hcall */
+	__be16 max_vterms;	/* vterms open at once */
+	__be32 rsvd[2];
 };
 
 /* an RPA command/response transport queue */
 struct crq_queue {
 	struct ibmvsm_crq_msg *msgs;
 	int size, cur;
+	unsigned int order;
 	dma_addr_t msg_token;
 	spinlock_t lock;
+	u64 full;		/* times the queue was found full */
+};
+
+#define IBMVSM_VTERM_HASH_BITS	8
+
+/* Transmit scheduler classes, in the order they are served */
+enum ibmvsm_tx_class {
+	IBMVSM_TX_LATENCY,
+	IBMVSM_TX_BULK,
+	IBMVSM_TX_CLASSES,
+};
+
+enum ibmvsm_stat_item {
+	IBMVSM_STAT_RX_BYTES,
+	IBMVSM_STAT_TX_BYTES,
+	IBMVSM_STAT_GET_CHARS,		/* H_GET_TERM_CHAR_LP calls */
+	IBMVSM_STAT_PUT_CHARS,		/* H_PUT_TERM_CHAR_LP calls */
+	IBMVSM_STAT_PUT_CHARS_BUSY,	/* ... answered with H_BUSY */
+	IBMVSM_STAT_OPEN_VTERM,		/* H_OPEN_VTERM_LP calls */
+	IBMVSM_STAT_CLOSE_VTERM,	/* H_CLOSE_VTERM_LP calls */
+	IBMVSM_STAT_RX_RING_FULL,	/* rx left in firmware, ring full */
+	IBMVSM_STAT_TX_RING_FULL,	/* writer found the tx ring full */
+	IBMVSM_STAT_RX_OBS_DROPPED,	/* bytes lost to lagging observers */
+	IBMVSM_STAT_CRQ_ENTRIES,
+	IBMVSM_STAT_CRQ_PASSES,
+	IBMVSM_STAT_CRQ_IRQS,		/* CRQ interrupts taken */
+	IBMVSM_STAT_CRQ_POLLS,		/* passes run from the poll timer */
+	IBMVSM_STAT_CRQ_COALESCE,	/* switches to polling mode */
+	IBMVSM_STAT_NR,
+};
+
+enum ibmvsm_lat_item {
+	IBMVSM_LAT_GET_CHARS,
+	IBMVSM_LAT_PUT_CHARS,
+	IBMVSM_LAT_NR,
 };
 
-/* VSM server adapter settings */
+/* Bucket n counts hcalls that took [2^n, 2^(n+1)) ns */
+#define IBMVSM_LAT_BUCKETS	32
+
+struct ibmvsm_stats {
+	u64 count[IBMVSM_STAT_NR];
+	u64 lat[IBMVSM_LAT_NR][IBMVSM_LAT_BUCKETS];
+};
+
+struct ibmvsm_vterm;
+struct ibmvsm_hcall_ops;
+
+/* VSM server adapter settings, one per VSM IOA */
 struct crq_server_adapter {
 	struct device *dev;
+	u32 state;
+	int index;
+	unsigned int cpu;
+	char name[16];
+	struct miscdevice miscdev;
+	struct kref kref;
+	struct mutex vterm_mutex;	/* vterm reservation, open and close */
 	struct crq_queue queue;
 	u32 liobn;
 	u32 riobn;
 	struct tasklet_struct work_task;
+	struct work_struct crq_work;
+	struct hrtimer poll_timer;	/* CRQ service while coalescing */
+	ktime_t irq_window;		/* end of the interrupt rate window */
+	unsigned int irq_count;		/* interrupts in the window */
+	unsigned int poll_idle;		/* empty polls in a row */
+	bool polling;			/* interrupts off, poll_timer serves */
+	bool crq_stopped;		/* CRQ being released, no more passes */
+	struct work_struct reset_work;	/* CRQ reset in process context */
+	struct work_struct resume_work;	/* reopen vterms after a reset */
+	struct delayed_work version_work;	/* version exchange timeout */
+	unsigned long version_deadline;	/* jiffies, while version_wait */
+	bool version_wait;		/* VSM_MSG_VER_EXCH not answered yet */
+	bool resetting;			/* vterms suspended, not yet resumed */
+	u32 resets;			/* CRQ resets, under queue.lock */
+	u16 version;			/* negotiated, 0 if the partner has none */
+	u32 max_chars;			/* bytes per get/put chars hcall */
+	u32 max_open;			/* vterms that may be open at once */
+	unsigned int nr_open;		/* under vterm_mutex */
+	unsigned int history_kb;	/* allocated, under vterm_mutex */
+	struct ibmvsm_vterm **vterms;
+	unsigned int nr_vterms;
+	unsigned long *rx_pending;	/* vterms with rx data left in firmware */
+	struct list_head free_vterms;
+	DECLARE_HASHTABLE(vterm_hash, IBMVSM_VTERM_HASH_BITS);
+	DECLARE_HASHTABLE(open_hash, IBMVSM_VTERM_HASH_BITS); /* vterm_mutex */
+	/* Detached vterms by partner ids, under vterm_mutex */
+	DECLARE_HASHTABLE(detached_hash, IBMVSM_VTERM_HASH_BITS);
+	struct ibmvsm_stats __percpu *stats;
+	struct work_struct tx_work;	/* transmit scheduler */
+	struct mutex tx_mutex;		/* held while transmitting */
+	spinlock_t tx_sched_lock;	/* protects tx_active */
+	struct list_head tx_active[IBMVSM_TX_CLASSES];	/* vterms with data */
+	struct dentry *debugfs;
+	const struct ibmvsm_hcall_ops *ops;
+	void *backend;			/* private to the hcall backend */
 };
 
-struct ibmvsm_struct {
-	u32 state;
-	struct crq_server_adapter *adapter;
+/* Byte ring with a single producer and a single consumer. The indices are
+ * in a ibmvsm_ring_ctrl that userspace can map along with buf, so they are
+ * not trusted: size is kept here and every access is masked and clamped.
+ * The index the kernel itself advances, the receive head and the transmit
+ * tail, lives in the vterm and is only ever written to ctrl.
+ */
+struct ibmvsm_ring {
+	char *buf;
+	u32 size;
+	struct ibmvsm_ring_ctrl *ctrl;
 };
 
-struct ibmvmc_file_session;
+struct ibmvsm_file_session;
 
+/* Allocated cache line aligned, with the transmit side on its own line so
+ * writers and the CRQ tasklet do not false-share.
+ */
 struct ibmvsm_vterm {
 	u64 console_token;
 	u32 state;
-	u32 rsvd;
+	u32 index;
+	u32 session_id;		/* partner vterm, to reopen it after a reset */
+	u32 partition_id;
 	struct crq_server_adapter *adapter;
-	struct ibmvmc_file_session *file_session;
+	struct ibmvsm_file_session *file_session;
+	u64 owner;			/* id of the session that opened it */
+	struct hlist_node hash_node;
+	u64 open_token;			/* console token when opened */
+	struct hlist_node open_node;	/* on adapter->open_hash */
+	struct hlist_node detached_node;	/* on adapter->detached_hash */
+	struct list_head free_list;
+	struct ibmvsm_stats __percpu *stats;	/* allocated while open */
+	struct ibmvsm_mmap_ctrl *ctrl;		/* ring indices, while bound */
+	char *history;			/* last received bytes, under lock */
+	u32 history_size;
+	u64 history_head;		/* bytes ever written to history */
+	bool linger;			/* detach instead of closing */
+	bool detached;			/* open without a session, no rings */
+	bool orphaned;			/* failed, its session still bound */
 	spinlock_t lock;
+	struct mutex rx_lock;
+	wait_queue_head_t rx_wait;
+	struct ibmvsm_ring rx;
+	struct list_head observers;	/* under lock */
+	wait_queue_head_t obs_wait;
+	struct mutex obs_lock;		/* keeps rx while observers copy */
+	u32 rx_head;			/* rx producer index, kernel only */
+	u32 rx_hold;			/* cursor of the slowest blocker */
+	u32 rx_blockers;		/* VSM_OBSERVE_BLOCK observers */
+	struct mutex tx_lock ____cacheline_aligned_in_smp;
+	wait_queue_head_t tx_wait;
+	struct ibmvsm_ring tx;
+	u32 tx_tail;			/* tx consumer index, kernel only */
+	struct delayed_work tx_work;	/* H_BUSY backoff */
+	unsigned long tx_backoff;	/* current H_BUSY backoff in jiffies */
+	u64 tx_busy;			/* H_BUSY returns from put chars */
+	struct list_head tx_node;	/* on adapter->tx_active */
+	u32 tx_deficit;			/* hcalls left of the current turn */
+	u32 tx_weight;
+	u32 tx_class;			/* enum ibmvsm_tx_class */
+	struct ibmvsm_mux *mux;		/* multiplexed session, if any */
+	struct ibmvsm_mux_member *mux_member;	/* under mux->lock */
+} ____cacheline_aligned_in_smp;
+
+/* A read-only session following the receive ring of another's vterm */
+struct ibmvsm_observer {
+	struct list_head node;		/* on vterm->observers */
+	struct ibmvsm_vterm *vterm;
+	u32 cursor;			/* next rx byte, written under lock */
+	bool block;			/* VSM_OBSERVE_BLOCK */
+	bool hup;			/* rings gone, written under lock */
+};
+
+struct ibmvsm_mux;
+
+/* A vterm opened by a multiplexed session */
+struct ibmvsm_mux_member {
+	struct list_head node;		/* on mux->members */
+	struct list_head ready;		/* on mux->ready */
+	wait_queue_entry_t rx_wq;	/* on vterm->rx_wait */
+	wait_queue_entry_t tx_wq;	/* on vterm->tx_wait */
+	struct ibmvsm_mux *mux;
+	struct ibmvsm_vterm *vterm;	/* NULL once hung up */
+	u64 token;			/* console token when opened */
+	bool hup;			/* closed underneath, not yet read */
+};
+
+/* State of a file session in multiplex mode */
+struct ibmvsm_mux {
+	spinlock_t lock;		/* members, ready, member->vterm */
+	struct list_head members;
+	struct list_head ready;		/* members to visit on read */
+	wait_queue_head_t wait;
+	struct mutex rx_lock;		/* one reader at a time */
+	struct mutex tx_lock;		/* one writer at a time */
+	unsigned long *closing;		/* under vterm_mutex */
 };
 
 struct ibmvsm_file_session {
 	struct file *file;
+	struct crq_server_adapter *adapter;
+	u64 id;				/* owner of the vterms it opens */
+	struct ibmvsm_vterm *vterm;
 	bool valid;
+	struct ibmvsm_mux *mux;		/* multiplex mode, never valid */
+	struct ibmvsm_observer *observer;	/* read-only, never valid */
 };
 
-#define h_reg_crq(ua, tok, sz) \
-		  plpar_hcall_norets(H_REG_CRQ, ua, tok, sz)
-#define h_free_crq(ua) \
-		   plpar_hcall_norets(H_FREE_CRQ, ua)
-#define h_send_crq(ua, d1, d2) \
-		   plpar_hcall_norets(H_SEND_CRQ, ua, d1, d2)
-#define h_get_term_char_lp(buf, ua, tok) \
-		   plpar_hcall_norets(H_GET_TERM_CHAR_LP, buf, ua, tok)
-#define h_put_term_char_lp(ua, tok, len, d1, d2) \
-		   plpar_hcall_norets(H_PUT_TERM_CHAR_LP, ua, tok, len, d1, d2)
-#define h_open_vterm_lp(ua, sid, pid) \
-		   plpar_hcall_norets(H_OPEN_VTERM_LP, ua, sid, pid)
-#define h_close_vterm_lp(ua, tok) \
-		   plpar_hcall_norets(H_CLOSE_VTERM_LP, ua, tok)
+/**
+ * struct ibmvsm_hcall_ops - Hypervisor backend of an adapter
+ *
+ * Every hypervisor interaction of the driver goes through one of these.
+ * The pseries backend makes the real hcalls; ibmvsm_sim provides a
+ * simulated hypervisor. Hcall methods return H_* codes.
+ *
+ * @max_chars:		most bytes one get or put chars hcall can carry
+ * @version_exchange:	the partner answers VSM_MSG_VER_EXCH; without it
+ *			the driver goes straight to the defaults
+ * @probe:		optional, called once the adapter is allocated
+ * @reg_crq:		register adapter->queue with the hypervisor
+ * @free_crq:		deregister adapter->queue
+ * @send_crq:		send a CRQ message to the partner
+ * @open_vterm:		open a partner vterm, returning its console token
+ * @close_vterm:	close a partner vterm
+ * @get_term_char:	fetch up to adapter->max_chars bytes into @buf
+ * @put_term_char:	send @len (at most adapter->max_chars) bytes from @buf
+ * @request_irq:	hook @handler up to the adapter interrupt
+ * @free_irq:		release the adapter interrupt
+ * @enable_interrupts:	unmask the adapter interrupt
+ * @disable_interrupts:	mask the adapter interrupt
+ */
+struct ibmvsm_hcall_ops {
+	unsigned int max_chars;
+	bool version_exchange;
+	int (*probe)(struct crq_server_adapter *adapter);
+	long (*reg_crq)(struct crq_server_adapter *adapter);
+	long (*free_crq)(struct crq_server_adapter *adapter);
+	long (*send_crq)(struct crq_server_adapter *adapter,
+			 u64 word1, u64 word2);
+	long (*open_vterm)(struct crq_server_adapter *adapter,
+			   u32 session_id, u32 partition_id, u64 *token);
+	long (*close_vterm)(struct crq_server_adapter *adapter, u64 token);
+	long (*get_term_char)(struct crq_server_adapter *adapter, u64 token,
+			      char *buf, unsigned long *len);
+	long (*put_term_char)(struct crq_server_adapter *adapter, u64 token,
+			      const char *buf, unsigned long len);
+	int (*request_irq)(struct crq_server_adapter *adapter,
+			   irq_handler_t handler);
+	void (*free_irq)(struct crq_server_adapter *adapter);
+	int (*enable_interrupts)(struct crq_server_adapter *adapter);
+	int (*disable_interrupts)(struct crq_server_adapter *adapter);
+};
+
+#define h_reg_crq(adapter) \
+		  ((adapter)->ops->reg_crq(adapter))
+#define h_free_crq(adapter) \
+		   ((adapter)->ops->free_crq(adapter))
+#define h_send_crq(adapter, d1, d2) \
+		   ((adapter)->ops->send_crq(adapter, d1, d2))
+#define h_get_term_char_lp(adapter, tok, buf, len) \
+		   ((adapter)->ops->get_term_char(adapter, tok, buf, len))
+#define h_put_term_char_lp(adapter, tok, buf, len) \
+		   ((adapter)->ops->put_term_char(adapter, tok, buf, len))
+#define h_open_vterm_lp(adapter, sid, pid, tok) \
+		   ((adapter)->ops->open_vterm(adapter, sid, pid, tok))
+#define h_close_vterm_lp(adapter, tok) \
+		   ((adapter)->ops->close_vterm(adapter, tok))
+
+int ibmvsm_add_adapter(struct device *dev, const struct ibmvsm_hcall_ops *ops,
+		       void *backend);
+void ibmvsm_remove_adapter(struct crq_server_adapter *adapter);
 
 #endif /* __IBMVSM_H */
@@ -0,0 +1,708 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * IBM Power Systems Virtual Serial Multiplex simulated hypervisor.
+ *
+ * Registers ibmvsm adapters backed by a software CRQ and fake partner
+ * vterms instead of the pseries hypervisor, so the driver can be exercised
+ * and benchmarked on any machine.
+ *
+ * Copyright (c) 2018 IBM Corp.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/dma-mapping.h>
+#include <linux/hrtimer.h>
+#include <linux/delay.h>
+#include <linux/interrupt.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+
+#include "ibmvsm.h"
+
+/* Data a partner holds for the driver before it stops producing */
+#define IBMVSM_SIM_BACKLOG	(64 * 1024)
+/* Per partner buffer for loopback mode, a power of two */
+#define IBMVSM_SIM_ECHO_SIZE	4096
+
+static unsigned int nr_adapters = 1;
+module_param(nr_adapters, uint, 0444);
+MODULE_PARM_DESC(nr_adapters, "Number of simulated adapters");
+
+static unsigned int nr_partners = 64;
+module_param(nr_partners, uint, 0444);
+MODULE_PARM_DESC(nr_partners, "Partner vterms each adapter can have open");
+
+static unsigned int tick_us = 1000;
+module_param(tick_us, uint, 0444);
+MODULE_PARM_DESC(tick_us, "Partner simulation period in microseconds");
+
+static unsigned int rx_rate;
+module_param(rx_rate, uint, 0644);
+MODULE_PARM_DESC(rx_rate,
+		 "Bytes per second each open partner sends, 0 for none");
+
+static unsigned int tx_rate;
+module_param(tx_rate, uint, 0644);
+MODULE_PARM_DESC(tx_rate,
+		 "Bytes per second each partner accepts before answering H_BUSY, 0 for no limit");
+
+static bool loopback;
+module_param(loopback, bool, 0444);
+MODULE_PARM_DESC(loopback,
+		 "Partners send back what they are sent, instead of rx_rate data");
+
+static unsigned int max_chars = IBMVSM_MAX_CHARS;
+module_param(max_chars, uint, 0444);
+MODULE_PARM_DESC(max_chars,
+		 "Bytes per get/put chars call offered in the version exchange");
+
+static unsigned int hcall_delay_ns;
+module_param(hcall_delay_ns, uint, 0644);
+MODULE_PARM_DESC(hcall_delay_ns,
+		 "Time spent in each simulated get/put chars hcall");
+
+struct ibmvsm_sim_partner {
+	u64 token;		/* 0 while closed */
+	u64 rx_backlog;		/* bytes waiting to be fetched by the driver */
+	u64 rx_frac;		/* rx_rate remainder carried between ticks */
+	u64 tx_credit;		/* bytes accepted before H_BUSY */
+	u64 tx_frac;
+	u64 rx_bytes;
+	u64 tx_bytes;
+	bool signalled;		/* VTERM interrupt sent, backlog not drained */
+};
+
+struct ibmvsm_sim {
+	struct device *dev;
+	struct crq_server_adapter *adapter;
+	spinlock_t lock;
+	bool registered;
+	bool irq_enabled;
+	irq_handler_t handler;
+	struct tasklet_struct irq_tasklet;	/* delivers the interrupt */
+	int prod;			/* next CRQ entry to fill */
+	u32 generation;			/* makes console tokens unique */
+	unsigned int inject_busy;	/* put chars calls to fail */
+	unsigned int inject_resource;	/* reg crq calls to fail */
+	u64 crq_dropped;		/* messages lost to a full CRQ */
+	struct hrtimer timer;
+	struct dentry *debugfs;
+	char *echo;			/* loopback buffers, one per partner */
+	struct ibmvsm_sim_partner partners[];
+};
+
+static struct ibmvsm_sim **ibmvsm_sims;
+static struct dentry *ibmvsm_sim_debugfs_root;
+
+/**
+ * ibmvsm_sim_post_msg - Put a message on the adapter's CRQ
+ *
+ * @sim:	ibmvsm_sim struct, lock held
+ * @msg:	the 16 byte message, valid byte included
+ *
+ * Like the hypervisor, drops the message if the CRQ is full. Raises the
+ * adapter interrupt if it is enabled, see ibmvsm_sim_irq().
+ */
+static void ibmvsm_sim_post_msg(struct ibmvsm_sim *sim,
+				const struct ibmvsm_crq_msg *msg)
+{
+	struct crq_queue *queue = &sim->adapter->queue;
+	struct ibmvsm_crq_msg *crq;
+
+	if (!sim->registered)
+		return;
+
+	crq = &queue->msgs[sim->prod];
+	if (crq->valid & 0x80) {
+		sim->crq_dropped++;
+		return;
+	}
+
+	memcpy((u8 *)crq + 1, (const u8 *)msg + 1, sizeof(*crq) - 1);
+	/* The entry must be complete before it is marked valid */
+	dma_wmb();
+	crq->valid = msg->valid;
+
+	if (++sim->prod == queue->size)
+		sim->prod = 0;
+
+	if (sim->handler && READ_ONCE(sim->irq_enabled))
+		tasklet_schedule(&sim->irq_tasklet);
+}
+
+/*
+ * Deliver the adapter interrupt. Messages are posted from the tick, from
+ * hcalls and from process context, all with sim->lock held, so the
+ * handler is not called from there: it would run under the lock, and on
+ * several CPUs at once. A tasklet never runs concurrently with itself,
+ * which gives the single interrupt context the driver expects. Interrupts
+ * stay off around the handler as they would in hard irq context.
+ */
+static void ibmvsm_sim_irq(unsigned long data)
+{
+	struct ibmvsm_sim *sim = (struct ibmvsm_sim *)data;
+	irq_handler_t handler = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	if (sim->registered && READ_ONCE(sim->irq_enabled))
+		handler = sim->handler;
+	spin_unlock(&sim->lock);
+
+	if (handler)
+		handler(0, sim->adapter);
+	local_irq_restore(flags);
+}
+
+/* Post a message that only carries a console token */
+static void ibmvsm_sim_post(struct ibmvsm_sim *sim, u8 valid, u8 type,
+			    u64 token)
+{
+	struct ibmvsm_crq_msg msg = {
+		.valid = valid,
+		.type = type,
+		.console_token = cpu_to_be64(token),
+	};
+
+	ibmvsm_sim_post_msg(sim, &msg);
+}
+
+/* Answer a version exchange with what the simulated partners support */
+static void ibmvsm_sim_post_version(struct ibmvsm_sim *sim)
+{
+	struct ibmvsm_crq_version msg = {
+		.valid = CRQ_CMD_RSP,
+		.type = VSM_MSG_VERSION_EXCH_RSP,
+		.version = cpu_to_be16(IBMVSM_PROTOCOL_VERSION),
+		.max_chars = cpu_to_be16(max_chars),
+		.max_vterms = cpu_to_be16(min_t(u32, nr_partners, U16_MAX)),
+	};
+
+	BUILD_BUG_ON(sizeof(msg) != sizeof(struct ibmvsm_crq_msg));
+	ibmvsm_sim_post_msg(sim, (struct ibmvsm_crq_msg *)&msg);
+}
+
+static struct ibmvsm_sim_partner *
+ibmvsm_sim_find_partner(struct ibmvsm_sim *sim, u64 token)
+{
+	u32 slot = lower_32_bits(token) - 1;
+
+	if (slot >= nr_partners || sim->partners[slot].token != token)
+		return NULL;
+
+	return &sim->partners[slot];
+}
+
+/* Loopback buffer of a partner, NULL unless in loopback mode */
+static char *ibmvsm_sim_echo(struct ibmvsm_sim *sim,
+			     struct ibmvsm_sim_partner *partner)
+{
+	if (!sim->echo)
+		return NULL;
+
+	return sim->echo + (partner - sim->partners) * IBMVSM_SIM_ECHO_SIZE;
+}
+
+/*
+ * Queue transmitted bytes to come straight back. The echo buffer is indexed
+ * by the running tx and rx byte counts, so rx_backlog is what it holds.
+ * Signals the driver at once rather than on the next tick so round trips
+ * are not quantised to tick_us.
+ */
+static void ibmvsm_sim_echo_in(struct ibmvsm_sim *sim,
+			       struct ibmvsm_sim_partner *partner,
+			       const char *buf, unsigned long len)
+{
+	char *echo = ibmvsm_sim_echo(sim, partner);
+	unsigned long i;
+
+	for (i = 0; i < len; i++)
+		echo[(partner->tx_bytes + i) & (IBMVSM_SIM_ECHO_SIZE - 1)] =
+			buf[i];
+	partner->rx_backlog += len;
+
+	if (!partner->signalled) {
+		partner->signalled = true;
+		ibmvsm_sim_post(sim, CRQ_CMD_RSP, VSM_MSG_SIG_VTERM_INT,
+				partner->token);
+	}
+}
+
+/* Pace the partners: produce receive data and refill transmit credit */
+static enum hrtimer_restart ibmvsm_sim_tick(struct hrtimer *timer)
+{
+	struct ibmvsm_sim *sim = container_of(timer, struct ibmvsm_sim, timer);
+	u64 rx = loopback ? 0 : (u64)READ_ONCE(rx_rate) * tick_us;
+	u64 tx = (u64)READ_ONCE(tx_rate) * tick_us;
+	struct ibmvsm_sim_partner *partner;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	for (i = 0; sim->registered && i < nr_partners; i++) {
+		partner = &sim->partners[i];
+		if (!partner->token)
+			continue;
+
+		partner->rx_frac += rx;
+		partner->rx_backlog = min_t(u64, partner->rx_backlog +
+					    partner->rx_frac / USEC_PER_SEC,
+					    IBMVSM_SIM_BACKLOG);
+		partner->rx_frac %= USEC_PER_SEC;
+
+		partner->tx_frac += tx;
+		partner->tx_credit = min_t(u64, partner->tx_credit +
+					   partner->tx_frac / USEC_PER_SEC,
+					   max_t(u64, tx_rate,
+						 max_chars));
+		partner->tx_frac %= USEC_PER_SEC;
+
+		if (partner->rx_backlog && !partner->signalled) {
+			partner->signalled = true;
+			ibmvsm_sim_post(sim, CRQ_CMD_RSP,
+					VSM_MSG_SIG_VTERM_INT, partner->token);
+		}
+	}
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	hrtimer_forward_now(timer, ns_to_ktime((u64)tick_us * NSEC_PER_USEC));
+
+	return HRTIMER_RESTART;
+}
+
+static long ibmvsm_sim_reg_crq(struct crq_server_adapter *adapter)
+{
+	struct ibmvsm_sim *sim = adapter->backend;
+	unsigned long flags;
+	long rc = H_SUCCESS;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	if (sim->inject_resource) {
+		sim->inject_resource--;
+		rc = H_RESOURCE;
+	} else if (sim->registered) {
+		rc = H_RESOURCE;
+	} else {
+		sim->adapter = adapter;
+		sim->registered = true;
+		sim->prod = 0;
+	}
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return rc;
+}
+
+static long ibmvsm_sim_free_crq(struct crq_server_adapter *adapter)
+{
+	struct ibmvsm_sim *sim = adapter->backend;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	sim->registered = false;
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return H_SUCCESS;
+}
+
+static long ibmvsm_sim_send_crq(struct crq_server_adapter *adapter,
+				u64 word1, u64 word2)
+{
+	struct ibmvsm_sim *sim = adapter->backend;
+	__be64 words[2] = { cpu_to_be64(word1), cpu_to_be64(word2) };
+	struct ibmvsm_crq_msg *crq = (struct ibmvsm_crq_msg *)words;
+	unsigned long flags;
+	long rc = H_SUCCESS;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	if (!sim->registered)
+		rc = H_CLOSED;
+	else if (crq->valid == CRQ_INIT_MSG && crq->type == CRQ_INIT)
+		/* The partner is always up, answer right away */
+		ibmvsm_sim_post(sim, CRQ_INIT_MSG, CRQ_INIT_COMPLETE, 0);
+	else if (crq->valid == CRQ_CMD_RSP && crq->type == VSM_MSG_VER_EXCH)
+		ibmvsm_sim_post_version(sim);
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return rc;
+}
+
+static long ibmvsm_sim_open_vterm(struct crq_server_adapter *adapter,
+				  u32 session_id, u32 partition_id, u64 *token)
+{
+	struct ibmvsm_sim *sim = adapter->backend;
+	struct ibmvsm_sim_partner *partner;
+	unsigned long flags;
+	long rc = H_RESOURCE;
+	unsigned int i;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	for (i = 0; i < nr_partners; i++) {
+		partner = &sim->partners[i];
+		if (partner->token)
+			continue;
+
+		memset(partner, 0, sizeof(*partner));
+		partner->token = ((u64)++sim->generation << 32) | (i + 1);
+		partner->tx_credit = max_t(u64, tx_rate, max_chars);
+		*token = partner->token;
+		rc = H_SUCCESS;
+		break;
+	}
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return rc;
+}
+
+static long ibmvsm_sim_close_vterm(struct crq_server_adapter *adapter,
+				   u64 token)
+{
+	struct ibmvsm_sim *sim = adapter->backend;
+	struct ibmvsm_sim_partner *partner;
+	unsigned long flags;
+	long rc = H_PARAMETER;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	partner = ibmvsm_sim_find_partner(sim, token);
+	if (partner) {
+		partner->token = 0;
+		rc = H_SUCCESS;
+	}
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return rc;
+}
+
+static long ibmvsm_sim_get_term_char(struct crq_server_adapter *adapter,
+				     u64 token, char *buf,
+				     unsigned long *len)
+{
+	struct ibmvsm_sim *sim = adapter->backend;
+	struct ibmvsm_sim_partner *partner;
+	unsigned long flags, i, n = 0;
+	long rc = H_PARAMETER;
+
+	ndelay(READ_ONCE(hcall_delay_ns));
+
+	spin_lock_irqsave(&sim->lock, flags);
+	partner = ibmvsm_sim_find_partner(sim, token);
+	if (partner) {
+		char *echo = ibmvsm_sim_echo(sim, partner);
+
+		n = min_t(u64, partner->rx_backlog, max_chars);
+		/* A running byte count lets readers check ordering */
+		for (i = 0; i < n; i++)
+			buf[i] = echo ? echo[(partner->rx_bytes + i) &
+					     (IBMVSM_SIM_ECHO_SIZE - 1)] :
+					(char)(partner->rx_bytes + i);
+		partner->rx_bytes += n;
+		partner->rx_backlog -= n;
+		if (!partner->rx_backlog)
+			partner->signalled = false;
+		rc = H_SUCCESS;
+	}
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	*len = n;
+	return rc;
+}
+
+static long ibmvsm_sim_put_term_char(struct crq_server_adapter *adapter,
+				     u64 token, const char *buf,
+				     unsigned long len)
+{
+	struct ibmvsm_sim *sim = adapter->backend;
+	struct ibmvsm_sim_partner *partner;
+	unsigned long flags;
+	long rc = H_PARAMETER;
+
+	if (len > max_chars)
+		return H_PARAMETER;
+
+	ndelay(READ_ONCE(hcall_delay_ns));
+
+	spin_lock_irqsave(&sim->lock, flags);
+	partner = ibmvsm_sim_find_partner(sim, token);
+	if (!partner)
+		goto out;
+
+	if (sim->inject_busy) {
+		sim->inject_busy--;
+		rc = H_BUSY;
+	} else if (tx_rate && partner->tx_credit < len) {
+		rc = H_BUSY;
+	} else if (loopback &&
+		   partner->rx_backlog + len > IBMVSM_SIM_ECHO_SIZE) {
+		/* The driver has not fetched what was echoed yet */
+		rc = H_BUSY;
+	} else {
+		if (tx_rate)
+			partner->tx_credit -= len;
+		if (loopback)
+			ibmvsm_sim_echo_in(sim, partner, buf, len);
+		partner->tx_bytes += len;
+		rc = H_SUCCESS;
+	}
+out:
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return rc;
+}
+
+static int ibmvsm_sim_request_irq(struct crq_server_adapter *adapter,
+				  irq_handler_t handler)
+{
+	struct ibmvsm_sim *sim = adapter->backend;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	sim->handler = handler;
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return 0;
+}
+
+static void ibmvsm_sim_free_irq(struct crq_server_adapter *adapter)
+{
+	struct ibmvsm_sim *sim = adapter->backend;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	sim->handler = NULL;
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	/* Wait out a delivery that picked up the handler before */
+	tasklet_kill(&sim->irq_tasklet);
+}
+
+/* Called from the interrupt handler, so no locking */
+static int ibmvsm_sim_enable_interrupts(struct crq_server_adapter *adapter)
+{
+	struct ibmvsm_sim *sim = adapter->backend;
+
+	WRITE_ONCE(sim->irq_enabled, true);
+	return 0;
+}
+
+static int ibmvsm_sim_disable_interrupts(struct crq_server_adapter *adapter)
+{
+	struct ibmvsm_sim *sim = adapter->backend;
+
+	WRITE_ONCE(sim->irq_enabled, false);
+	return 0;
+}
+
+static const struct ibmvsm_hcall_ops ibmvsm_sim_ops = {
+	.max_chars		= IBMVSM_MAX_CHARS,
+	.version_exchange	= true,
+	.reg_crq		= ibmvsm_sim_reg_crq,
+	.free_crq		= ibmvsm_sim_free_crq,
+	.send_crq		= ibmvsm_sim_send_crq,
+	.open_vterm		= ibmvsm_sim_open_vterm,
+	.close_vterm		= ibmvsm_sim_close_vterm,
+	.get_term_char		= ibmvsm_sim_get_term_char,
+	.put_term_char		= ibmvsm_sim_put_term_char,
+	.request_irq		= ibmvsm_sim_request_irq,
+	.free_irq		= ibmvsm_sim_free_irq,
+	.enable_interrupts	= ibmvsm_sim_enable_interrupts,
+	.disable_interrupts	= ibmvsm_sim_disable_interrupts,
+};
+
+static int ibmvsm_sim_partners_show(struct seq_file *m, void *v)
+{
+	struct ibmvsm_sim *sim = m->private;
+	struct ibmvsm_sim_partner *partner;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	seq_printf(m, "crq_dropped %llu\n", sim->crq_dropped);
+	for (i = 0; i < nr_partners; i++) {
+		partner = &sim->partners[i];
+		if (!partner->token)
+			continue;
+
+		seq_printf(m, "0x%llx rx %llu tx %llu backlog %llu\n",
+			   partner->token, partner->rx_bytes,
+			   partner->tx_bytes, partner->rx_backlog);
+	}
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ibmvsm_sim_partners);
+
+/*
+ * Fault injection, one command per write:
+ *	busy <n>	answer the next n put chars calls with H_BUSY
+ *	resource <n>	answer the next n CRQ registrations with H_RESOURCE
+ *	transport	post a partner failed transport event
+ */
+static ssize_t ibmvsm_sim_inject_write(struct file *file,
+				       const char __user *ubuf, size_t count,
+				       loff_t *ppos)
+{
+	struct ibmvsm_sim *sim = file->private_data;
+	unsigned long flags;
+	unsigned int n = 0;
+	char buf[32];
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	spin_lock_irqsave(&sim->lock, flags);
+	if (sscanf(buf, "busy %u", &n) == 1)
+		sim->inject_busy = n;
+	else if (sscanf(buf, "resource %u", &n) == 1)
+		sim->inject_resource = n;
+	else if (!strncmp(buf, "transport", 9))
+		ibmvsm_sim_post(sim, CRQ_XPORT_EVENT, 0x01, 0);
+	else
+		count = -EINVAL;
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return count;
+}
+
+static const struct file_operations ibmvsm_sim_inject_fops = {
+	.owner	= THIS_MODULE,
+	.open	= simple_open,
+	.write	= ibmvsm_sim_inject_write,
+	.llseek	= no_llseek,
+};
+
+static struct ibmvsm_sim *ibmvsm_sim_create(unsigned int index)
+{
+	struct ibmvsm_sim *sim;
+	char name[32];
+	int rc;
+
+	sim = kzalloc(sizeof(*sim) + nr_partners * sizeof(sim->partners[0]),
+		      GFP_KERNEL);
+	if (!sim)
+		return ERR_PTR(-ENOMEM);
+
+	if (loopback) {
+		sim->echo = vzalloc(nr_partners * IBMVSM_SIM_ECHO_SIZE);
+		if (!sim->echo) {
+			kfree(sim);
+			return ERR_PTR(-ENOMEM);
+		}
+	}
+
+	spin_lock_init(&sim->lock);
+	tasklet_init(&sim->irq_tasklet, ibmvsm_sim_irq, (unsigned long)sim);
+	hrtimer_init(&sim->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sim->timer.function = ibmvsm_sim_tick;
+
+	snprintf(name, sizeof(name), "ibmvsm_sim%u", index);
+	sim->dev = root_device_register(name);
+	if (IS_ERR(sim->dev)) {
+		rc = PTR_ERR(sim->dev);
+		goto free_sim;
+	}
+
+	/* The driver DMA maps the CRQ */
+	rc = dma_coerce_mask_and_coherent(sim->dev, DMA_BIT_MASK(64));
+	if (rc)
+		goto unregister;
+
+	if (ibmvsm_sim_debugfs_root) {
+		sim->debugfs = debugfs_create_dir(name,
+						  ibmvsm_sim_debugfs_root);
+		debugfs_create_file("partners", 0444, sim->debugfs, sim,
+				    &ibmvsm_sim_partners_fops);
+		debugfs_create_file("inject", 0200, sim->debugfs, sim,
+				    &ibmvsm_sim_inject_fops);
+	}
+
+	hrtimer_start(&sim->timer, ns_to_ktime((u64)tick_us * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+
+	rc = ibmvsm_add_adapter(sim->dev, &ibmvsm_sim_ops, sim);
+	if (rc)
+		goto stop;
+
+	return sim;
+
+stop:
+	hrtimer_cancel(&sim->timer);
+	debugfs_remove_recursive(sim->debugfs);
+unregister:
+	root_device_unregister(sim->dev);
+free_sim:
+	vfree(sim->echo);
+	kfree(sim);
+	return ERR_PTR(rc);
+}
+
+static void ibmvsm_sim_destroy(struct ibmvsm_sim *sim)
+{
+	ibmvsm_remove_adapter(dev_get_drvdata(sim->dev));
+	hrtimer_cancel(&sim->timer);
+	debugfs_remove_recursive(sim->debugfs);
+	root_device_unregister(sim->dev);
+	vfree(sim->echo);
+	kfree(sim);
+}
+
+static int __init ibmvsm_sim_init(void)
+{
+	struct ibmvsm_sim *sim;
+	unsigned int i;
+
+	if (!nr_adapters || !nr_partners || !tick_us || !max_chars ||
+	    max_chars > IBMVSM_MAX_CHARS)
+		return -EINVAL;
+
+	ibmvsm_sims = kcalloc(nr_adapters, sizeof(*ibmvsm_sims), GFP_KERNEL);
+	if (!ibmvsm_sims)
+		return -ENOMEM;
+
+	ibmvsm_sim_debugfs_root = debugfs_create_dir("ibmvsm_sim", NULL);
+	if (IS_ERR(ibmvsm_sim_debugfs_root))
+		ibmvsm_sim_debugfs_root = NULL;
+
+	for (i = 0; i < nr_adapters; i++) {
+		sim = ibmvsm_sim_create(i);
+		if (IS_ERR(sim)) {
+			pr_err("ibmvsm_sim: adapter %u failed, rc %ld\n", i,
+			       PTR_ERR(sim));
+			while (i--)
+				ibmvsm_sim_destroy(ibmvsm_sims[i]);
+			debugfs_remove_recursive(ibmvsm_sim_debugfs_root);
+			kfree(ibmvsm_sims);
+			return PTR_ERR(sim);
+		}
+		ibmvsm_sims[i] = sim;
+	}
+
+	pr_info("ibmvsm_sim: %u adapters with %u partners each\n",
+		nr_adapters, nr_partners);
+
+	return 0;
+}
+
+static void __exit ibmvsm_sim_exit(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_adapters; i++)
+		ibmvsm_sim_destroy(ibmvsm_sims[i]);
+	debugfs_remove_recursive(ibmvsm_sim_debugfs_root);
+	kfree(ibmvsm_sims);
+}
+
+module_init(ibmvsm_sim_init);
+module_exit(ibmvsm_sim_exit);
+
+MODULE_DESCRIPTION("IBM VSM simulated hypervisor");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,152 @@
+/* SPDX-License-Identifier: GPL-2.0+
+ *
+ * linux/drivers/misc/ibmvsm_trace.h
+ *
+ * IBM Power Systems Virtual Serial Multiplex tracepoints
+ *
+ * Copyright (c) 2018 IBM Corp.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ibmvsm
+
+#if !defined(_IBMVSM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _IBMVSM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "ibmvsm.h"
+
+TRACE_EVENT(crq_recv,
+	TP_PROTO(struct crq_server_adapter *adapter,
+		 struct ibmvsm_crq_msg *crq),
+
+	TP_ARGS(adapter, crq),
+
+	TP_STRUCT__entry(
+		__string(name, adapter->name)
+		__field(u8, valid)
+		__field(u8, type)
+		__field(u64, console_token)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, adapter->name);
+		__entry->valid = crq->valid;
+		__entry->type = crq->type;
+		__entry->console_token = be64_to_cpu(crq->console_token);
+	),
+
+	TP_printk("%s valid=0x%02x type=0x%02x token=0x%llx",
+		  __get_str(name), __entry->valid, __entry->type,
+		  __entry->console_token)
+);
+
+DECLARE_EVENT_CLASS(hcall_chars,
+	TP_PROTO(struct ibmvsm_vterm *vterm, long rc, long len, u64 ns),
+
+	TP_ARGS(vterm, rc, len, ns),
+
+	TP_STRUCT__entry(
+		__string(name, vterm->adapter->name)
+		__field(u64, console_token)
+		__field(long, rc)
+		__field(long, len)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, vterm->adapter->name);
+		__entry->console_token = vterm->console_token;
+		__entry->rc = rc;
+		__entry->len = len;
+		__entry->ns = ns;
+	),
+
+	TP_printk("%s token=0x%llx rc=%ld len=%ld ns=%llu",
+		  __get_str(name), __entry->console_token, __entry->rc,
+		  __entry->len, __entry->ns)
+);
+
+DEFINE_EVENT(hcall_chars, hcall_put_chars,
+	TP_PROTO(struct ibmvsm_vterm *vterm, long rc, long len, u64 ns),
+	TP_ARGS(vterm, rc, len, ns)
+);
+
+DEFINE_EVENT(hcall_chars, hcall_get_chars,
+	TP_PROTO(struct ibmvsm_vterm *vterm, long rc, long len, u64 ns),
+	TP_ARGS(vterm, rc, len, ns)
+);
+
+TRACE_EVENT(vterm_state,
+	TP_PROTO(struct ibmvsm_vterm *vterm, u32 state),
+
+	TP_ARGS(vterm, state),
+
+	TP_STRUCT__entry(
+		__string(name, vterm->adapter->name)
+		__field(u32, index)
+		__field(u64, console_token)
+		__field(u32, old_state)
+		__field(u32, new_state)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, vterm->adapter->name);
+		__entry->index = vterm->index;
+		__entry->console_token = vterm->console_token;
+		__entry->old_state = vterm->state;
+		__entry->new_state = state;
+	),
+
+	TP_printk("%s vterm=%u token=0x%llx state %u -> %u",
+		  __get_str(name), __entry->index, __entry->console_token,
+		  __entry->old_state, __entry->new_state)
+);
+
+TRACE_EVENT(crq_reset,
+	TP_PROTO(struct crq_server_adapter *adapter, bool xport_event),
+
+	TP_ARGS(adapter, xport_event),
+
+	TP_STRUCT__entry(
+		__string(name, adapter->name)
+		__field(u32, state)
+		__field(bool, xport_event)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, adapter->name);
+		__entry->state = adapter->state;
+		__entry->xport_event = xport_event;
+	),
+
+	TP_printk("%s state=%u xport_event=%d",
+		  __get_str(name), __entry->state, __entry->xport_event)
+);
+
+TRACE_EVENT(crq_coalesce,
+	TP_PROTO(struct crq_server_adapter *adapter, bool polling),
+
+	TP_ARGS(adapter, polling),
+
+	TP_STRUCT__entry(
+		__string(name, adapter->name)
+		__field(bool, polling)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, adapter->name);
+		__entry->polling = polling;
+	),
+
+	TP_printk("%s polling=%d", __get_str(name), __entry->polling)
+);
+
+#endif /* _IBMVSM_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ibmvsm_trace
+#include <trace/define_trace.h>
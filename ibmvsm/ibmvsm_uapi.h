@@ -0,0 +1,135 @@
+/* SPDX-License-Identifier: GPL-2.0+ WITH Linux-syscall-note
+ *
+ * IBM Power Systems Virtual Serial Multiplex, userspace interface
+ *
+ * ioctls, their arguments and the layout of the mapped rings, shared by
+ * the driver and the programs using it.
+ *
+ * Copyright (c) 2018 IBM Corp.
+ */
+#ifndef IBMVSM_UAPI_H
+#define IBMVSM_UAPI_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* ioctl info */
+#define VSM_TYPE		0xCD
+#define VSM_IOCTL_SETID		_IOW(VSM_TYPE, 0x00, struct ibmvsm_setid)
+#define VSM_IOCTL_KICK		_IO(VSM_TYPE, 0x01)
+#define VSM_IOCTL_OPEN_BATCH	_IOWR(VSM_TYPE, 0x02, struct ibmvsm_open_batch)
+#define VSM_IOCTL_CLOSE_BATCH	_IOWR(VSM_TYPE, 0x03, struct ibmvsm_close_batch)
+#define VSM_IOCTL_TX_PRIO	_IOW(VSM_TYPE, 0x04, struct ibmvsm_tx_prio)
+#define VSM_IOCTL_GET_HISTORY	_IOWR(VSM_TYPE, 0x05, struct ibmvsm_history)
+#define VSM_IOCTL_LINGER	_IOW(VSM_TYPE, 0x06, __u32)
+#define VSM_IOCTL_MUX_OPEN	_IOWR(VSM_TYPE, 0x07, struct ibmvsm_open_batch)
+#define VSM_IOCTL_MUX_CLOSE	_IOWR(VSM_TYPE, 0x08, struct ibmvsm_close_batch)
+#define VSM_IOCTL_OBSERVE	_IOW(VSM_TYPE, 0x09, struct ibmvsm_observe)
+
+/* VSM_IOCTL_SETID argument, the partner vterm to open for a file session */
+struct ibmvsm_setid {
+	__u32 session_id;
+	__u32 partition_id;
+};
+
+/* VSM_IOCTL_OPEN_BATCH entry, each opened vterm gets its own file session */
+struct ibmvsm_open_entry {
+	__u32 session_id;	/* in */
+	__u32 partition_id;	/* in */
+	__s32 status;		/* out, 0 or a negative errno */
+	__s32 fd;		/* out, the bound session, or -1 */
+	__u64 console_token;	/* out */
+};
+
+struct ibmvsm_open_batch {
+	__u32 count;
+	__u32 flags;		/* O_CLOEXEC, O_NONBLOCK for the new files */
+	__u64 entries;		/* user pointer to count entries */
+};
+
+/* VSM_IOCTL_CLOSE_BATCH entry */
+struct ibmvsm_close_entry {
+	__u64 console_token;	/* in */
+	__s32 status;		/* out, 0 or a negative errno */
+	__u32 rsvd;
+};
+
+struct ibmvsm_close_batch {
+	__u32 count;
+	__u32 flags;		/* must be 0 */
+	__u64 entries;		/* user pointer to count entries */
+};
+
+/* VSM_IOCTL_TX_PRIO argument, how a bound session shares transmit hcalls */
+struct ibmvsm_tx_prio {
+	__u32 weight;		/* 1 to IBMVSM_TX_MAX_WEIGHT, 1 when bound */
+	__u32 flags;
+};
+
+/* ibmvsm_tx_prio flags */
+#define VSM_TX_LOW_LATENCY	0x1	/* served ahead of bulk sessions */
+
+#define IBMVSM_TX_MAX_WEIGHT	64
+
+/* VSM_IOCTL_GET_HISTORY argument */
+struct ibmvsm_history {
+	__u64 buf;		/* user pointer */
+	__u32 len;		/* size of buf */
+	__u32 flags;		/* must be 0 */
+};
+
+/* Largest history_kb a vterm is given */
+#define IBMVSM_HISTORY_MAX_KB	1024
+
+/*
+ * Record header of a multiplexed session, len bytes of payload follow
+ * without padding. console_token is the token the vterm was opened with,
+ * it stays the same across a CRQ reset.
+ */
+struct ibmvsm_mux_hdr {
+	__u64 console_token;
+	__u32 flags;
+	__u32 len;
+};
+
+/* ibmvsm_mux_hdr flags, only set on read */
+#define VSM_MUX_HUP		0x1	/* vterm closed underneath, len 0 */
+
+/* VSM_IOCTL_OBSERVE argument, an open vterm to follow read-only */
+struct ibmvsm_observe {
+	__u64 console_token;
+	__u32 flags;
+	__u32 rsvd;		/* must be 0 */
+};
+
+/* ibmvsm_observe flags, an observer falling behind drops the oldest data */
+#define VSM_OBSERVE_BLOCK	0x1	/* hold receive back instead */
+
+/* mmap offsets of the shared areas of a bound session */
+#define VSM_MMAP_CTRL		0x00000000ULL
+#define VSM_MMAP_RX		0x10000000ULL
+#define VSM_MMAP_TX		0x20000000ULL
+
+/* ibmvsm_ring_ctrl flags */
+#define VSM_RING_NEED_KICK	0x1	/* VSM_IOCTL_KICK to make progress */
+
+/*
+ * Indices of one ring, shared with userspace at VSM_MMAP_CTRL. head and
+ * tail are free running byte counts, data lives at (index & (size - 1)).
+ * The producer and consumer halves are on separate 128 byte lines.
+ */
+struct ibmvsm_ring_ctrl {
+	__u32 head;		/* written by the producer */
+	__u32 size;
+	__u32 flags;		/* written by the kernel */
+	__u32 rsvd0[29];
+	__u32 tail;		/* written by the consumer */
+	__u32 rsvd1[31];
+};
+
+struct ibmvsm_mmap_ctrl {
+	struct ibmvsm_ring_ctrl rx;	/* kernel produces, user consumes */
+	struct ibmvsm_ring_ctrl tx;	/* user produces, kernel consumes */
+};
+
+#endif /* IBMVSM_UAPI_H */
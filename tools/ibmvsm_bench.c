@@ -0,0 +1,737 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ibmvsm_bench - IBM Power Systems Virtual Serial Multiplex benchmark
+ *
+ * Opens sessions on an ibmvsm misc device, binds each to a partner vterm
+ * with VSM_IOCTL_SETID and measures streaming throughput or echo round trip
+ * latency. Results are printed as a single JSON object.
+ *
+ * With -M throughput is measured through the mapped receive and transmit
+ * rings instead of read() and write().
+ *
+ * Round trips need a partner that sends back what it is sent, such as the
+ * ibmvsm_sim module loaded with loopback=1. With -L no device is used at
+ * all: each session talks to an in-process echo thread over a socketpair,
+ * which gives a baseline for the benchmark itself on any Linux host.
+ *
+ * Copyright (c) 2018 IBM Corp.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "ibmvsm_uapi.h"
+
+#define NSEC_PER_SEC		1000000000ULL
+/* A round trip taking longer than this counts as lost */
+#define LATENCY_TIMEOUT_MS	1000
+/* How long SETID may keep failing while the adapter finishes resetting */
+#define SETID_TIMEOUT_MS	5000
+#define SETID_RETRY_MS		10
+
+enum bench_mode {
+	MODE_THROUGHPUT,
+	MODE_LATENCY,
+};
+
+struct session {
+	int fd;
+	int peer;			/* loopback echo side, -1 otherwise */
+	pthread_t thread;
+	pthread_t echo_thread;
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint64_t syscalls;
+	uint64_t mismatches;		/* received bytes out of sequence */
+	uint64_t timeouts;
+	uint64_t *samples;		/* round trip times in ns */
+	size_t nr_samples;
+	size_t max_samples;
+	int error;
+};
+
+static struct {
+	const char *device;
+	const char *stats_path;
+	unsigned int sessions;
+	uint32_t session_id;
+	uint32_t partition_id;
+	enum bench_mode mode;
+	unsigned int seconds;
+	size_t block;
+	size_t msg;
+	int loopback;
+	int mapped;
+} opt = {
+	.device		= "/dev/ibmvsm",
+	.sessions	= 1,
+	.mode		= MODE_THROUGHPUT,
+	.seconds	= 5,
+	.block		= 4096,
+	.msg		= 16,
+};
+
+static uint64_t deadline;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Both the tool and the simulated partners send a running byte count, so
+ * the data received is checked the same way whether it was echoed or not.
+ */
+static void fill(char *buf, size_t len, uint64_t offset)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (char)(offset + i);
+}
+
+static uint64_t check(const char *buf, size_t len, uint64_t offset)
+{
+	uint64_t bad = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		bad += buf[i] != (char)(offset + i);
+
+	return bad;
+}
+
+static void *echo_thread(void *arg)
+{
+	struct session *s = arg;
+	char buf[65536];
+	ssize_t n, done, rc;
+
+	while ((n = read(s->peer, buf, sizeof(buf))) > 0) {
+		for (done = 0; done < n; done += rc) {
+			rc = send(s->peer, buf + done, n - done, MSG_NOSIGNAL);
+			if (rc < 0)
+				return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * SETID fails with EAGAIN until the adapter has finished its version
+ * exchange, after probe or a CRQ reset, so keep trying for a while.
+ */
+static int session_setid(struct session *s, const struct ibmvsm_setid *id)
+{
+	const struct timespec pause = {
+		.tv_nsec = SETID_RETRY_MS * 1000000L,
+	};
+	unsigned int tries = SETID_TIMEOUT_MS / SETID_RETRY_MS;
+
+	while (ioctl(s->fd, VSM_IOCTL_SETID, id)) {
+		if (errno != EAGAIN || !tries--)
+			return -errno;
+		nanosleep(&pause, NULL);
+	}
+
+	return 0;
+}
+
+static int session_open(struct session *s, unsigned int index)
+{
+	struct ibmvsm_setid id = {
+		.session_id	= opt.session_id + index,
+		.partition_id	= opt.partition_id,
+	};
+	int sv[2], rc;
+
+	s->peer = -1;
+
+	if (opt.loopback) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+			return -errno;
+		s->fd = sv[0];
+		s->peer = sv[1];
+		if (pthread_create(&s->echo_thread, NULL, echo_thread, s))
+			return -EAGAIN;
+	} else {
+		s->fd = open(opt.device, O_RDWR);
+		if (s->fd < 0)
+			return -errno;
+		rc = session_setid(s, &id);
+		if (rc)
+			return rc;
+	}
+
+	return fcntl(s->fd, F_SETFL, O_NONBLOCK) ? -errno : 0;
+}
+
+static void session_close(struct session *s)
+{
+	if (s->fd >= 0)
+		close(s->fd);
+	if (s->peer >= 0) {
+		pthread_join(s->echo_thread, NULL);
+		close(s->peer);
+	}
+}
+
+/* Stream in both directions until the deadline, with read() and write() */
+static void *throughput_thread(void *arg)
+{
+	struct session *s = arg;
+	struct pollfd pfd = { .fd = s->fd };
+	char *wbuf = malloc(opt.block);
+	char *rbuf = malloc(opt.block);
+	ssize_t n;
+
+	if (!wbuf || !rbuf) {
+		s->error = ENOMEM;
+		goto out;
+	}
+
+	while (now_ns() < deadline) {
+		pfd.events = POLLIN | POLLOUT;
+		s->syscalls++;
+		if (poll(&pfd, 1, 100) < 0) {
+			s->error = errno;
+			break;
+		}
+
+		if (pfd.revents & POLLOUT) {
+			fill(wbuf, opt.block, s->tx_bytes);
+			s->syscalls++;
+			n = write(s->fd, wbuf, opt.block);
+			if (n > 0)
+				s->tx_bytes += n;
+			else if (n < 0 && errno != EAGAIN) {
+				s->error = errno;
+				break;
+			}
+		}
+
+		if (pfd.revents & POLLIN) {
+			s->syscalls++;
+			n = read(s->fd, rbuf, opt.block);
+			if (n > 0) {
+				s->mismatches += check(rbuf, n, s->rx_bytes);
+				s->rx_bytes += n;
+			} else if (n < 0 && errno != EAGAIN) {
+				s->error = errno;
+				break;
+			}
+		}
+
+		if (pfd.revents & (POLLERR | POLLHUP)) {
+			s->error = EPIPE;
+			break;
+		}
+	}
+out:
+	free(wbuf);
+	free(rbuf);
+	return NULL;
+}
+
+/* Ask the driver to look at the rings if it has gone idle on one */
+static void kick(struct session *s, struct ibmvsm_ring_ctrl *ring)
+{
+	/* Publish our index before reading the flag the driver sets */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->flags, __ATOMIC_RELAXED) &
+	    VSM_RING_NEED_KICK) {
+		s->syscalls++;
+		if (ioctl(s->fd, VSM_IOCTL_KICK))
+			s->error = errno;
+	}
+}
+
+/*
+ * Stream in both directions until the deadline through the mapped rings.
+ * Only sleeps in poll() when there is nothing to read and no room to write.
+ */
+static void *throughput_mapped_thread(void *arg)
+{
+	struct session *s = arg;
+	struct pollfd pfd = { .fd = s->fd, .events = POLLIN | POLLOUT };
+	long page = sysconf(_SC_PAGESIZE);
+	struct ibmvsm_mmap_ctrl *ctrl;
+	uint32_t head, tail, n, i;
+	char *rx, *tx;
+	int progress;
+
+	ctrl = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd,
+		    VSM_MMAP_CTRL);
+	if (ctrl == MAP_FAILED) {
+		s->error = errno;
+		return NULL;
+	}
+
+	rx = mmap(NULL, ctrl->rx.size, PROT_READ, MAP_SHARED, s->fd,
+		  VSM_MMAP_RX);
+	tx = mmap(NULL, ctrl->tx.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		  s->fd, VSM_MMAP_TX);
+	if (rx == MAP_FAILED || tx == MAP_FAILED) {
+		s->error = errno;
+		goto out;
+	}
+
+	while (!s->error && now_ns() < deadline) {
+		progress = 0;
+
+		head = __atomic_load_n(&ctrl->rx.head, __ATOMIC_ACQUIRE);
+		tail = ctrl->rx.tail;
+		n = head - tail;
+		if (n) {
+			for (i = 0; i < n; i++)
+				s->mismatches +=
+					rx[(tail + i) & (ctrl->rx.size - 1)] !=
+					(char)(s->rx_bytes + i);
+			__atomic_store_n(&ctrl->rx.tail, head,
+					 __ATOMIC_RELEASE);
+			s->rx_bytes += n;
+			kick(s, &ctrl->rx);
+			progress = 1;
+		}
+
+		tail = __atomic_load_n(&ctrl->tx.tail, __ATOMIC_ACQUIRE);
+		head = ctrl->tx.head;
+		n = ctrl->tx.size - (head - tail);
+		if (n > opt.block)
+			n = opt.block;
+		if (n) {
+			for (i = 0; i < n; i++)
+				tx[(head + i) & (ctrl->tx.size - 1)] =
+					(char)(s->tx_bytes + i);
+			__atomic_store_n(&ctrl->tx.head, head + n,
+					 __ATOMIC_RELEASE);
+			s->tx_bytes += n;
+			kick(s, &ctrl->tx);
+			progress = 1;
+		}
+
+		if (progress)
+			continue;
+
+		s->syscalls++;
+		if (poll(&pfd, 1, 100) < 0)
+			s->error = errno;
+		else if (pfd.revents & (POLLERR | POLLHUP))
+			s->error = EPIPE;
+	}
+out:
+	if (rx != MAP_FAILED)
+		munmap(rx, ctrl->rx.size);
+	if (tx != MAP_FAILED)
+		munmap(tx, ctrl->tx.size);
+	munmap(ctrl, page);
+	return NULL;
+}
+
+static int add_sample(struct session *s, uint64_t ns)
+{
+	uint64_t *samples;
+
+	if (s->nr_samples == s->max_samples) {
+		s->max_samples = s->max_samples ? 2 * s->max_samples : 4096;
+		samples = realloc(s->samples,
+				  s->max_samples * sizeof(*samples));
+		if (!samples)
+			return -ENOMEM;
+		s->samples = samples;
+	}
+	s->samples[s->nr_samples++] = ns;
+
+	return 0;
+}
+
+/* One message in flight: send it and time until all of it is back */
+static void *latency_thread(void *arg)
+{
+	struct session *s = arg;
+	struct pollfd pfd = { .fd = s->fd };
+	char *wbuf = malloc(opt.msg);
+	char *rbuf = malloc(opt.msg);
+	size_t sent, got;
+	uint64_t start;
+	ssize_t n;
+	int rc;
+
+	if (!wbuf || !rbuf) {
+		s->error = ENOMEM;
+		goto out;
+	}
+
+	while (!s->error && now_ns() < deadline) {
+		fill(wbuf, opt.msg, s->tx_bytes);
+		start = now_ns();
+		sent = got = 0;
+
+		while (got < opt.msg) {
+			pfd.events = POLLIN | (sent < opt.msg ? POLLOUT : 0);
+			s->syscalls++;
+			rc = poll(&pfd, 1, LATENCY_TIMEOUT_MS);
+			if (rc <= 0) {
+				if (rc == 0)
+					s->timeouts++;
+				s->error = rc ? errno : ETIMEDOUT;
+				break;
+			}
+
+			if (pfd.revents & POLLOUT) {
+				s->syscalls++;
+				n = write(s->fd, wbuf + sent, opt.msg - sent);
+				if (n > 0)
+					sent += n;
+				else if (n < 0 && errno != EAGAIN)
+					s->error = errno;
+			}
+
+			if (pfd.revents & POLLIN) {
+				s->syscalls++;
+				n = read(s->fd, rbuf + got, opt.msg - got);
+				if (n > 0)
+					got += n;
+				else if (n < 0 && errno != EAGAIN)
+					s->error = errno;
+			}
+
+			if (s->error)
+				break;
+		}
+
+		s->tx_bytes += sent;
+		s->mismatches += check(rbuf, got, s->rx_bytes);
+		s->rx_bytes += got;
+		if (got == opt.msg && add_sample(s, now_ns() - start))
+			s->error = ENOMEM;
+	}
+out:
+	free(wbuf);
+	free(rbuf);
+	return NULL;
+}
+
+/* Hcall counters of the adapter, from its debugfs stats file */
+struct hcall_counts {
+	int valid;
+	uint64_t get_chars;
+	uint64_t put_chars;
+	uint64_t put_chars_busy;
+};
+
+static void read_hcalls(struct hcall_counts *hc)
+{
+	char line[128];
+	uint64_t val;
+	FILE *f;
+
+	memset(hc, 0, sizeof(*hc));
+	if (!opt.stats_path)
+		return;
+
+	f = fopen(opt.stats_path, "r");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "get_chars_hcalls %" SCNu64, &val) == 1)
+			hc->get_chars = val;
+		else if (sscanf(line, "put_chars_hcalls %" SCNu64, &val) == 1)
+			hc->put_chars = val;
+		else if (sscanf(line, "put_chars_busy %" SCNu64, &val) == 1)
+			hc->put_chars_busy = val;
+	}
+	hc->valid = 1;
+	fclose(f);
+}
+
+/* Busy time of the whole system, in seconds, from /proc/stat */
+static double system_busy(void)
+{
+	unsigned long long user, nice, system, idle, iowait, irq, softirq;
+	double busy = 0;
+	FILE *f;
+
+	f = fopen("/proc/stat", "r");
+	if (!f)
+		return 0;
+
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu", &user, &nice,
+		   &system, &idle, &iowait, &irq, &softirq) == 7)
+		busy = (double)(user + nice + system + irq + softirq) /
+		       sysconf(_SC_CLK_TCK);
+	fclose(f);
+
+	return busy;
+}
+
+static double process_busy(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *v, size_t n, double p)
+{
+	size_t i = (size_t)(p * n);
+
+	return n ? v[i < n ? i : n - 1] : 0;
+}
+
+static void print_per_byte(const char *name, uint64_t count, uint64_t bytes)
+{
+	if (bytes)
+		printf("  \"%s\": %.6f,\n", name, (double)count / bytes);
+	else
+		printf("  \"%s\": null,\n", name);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -d DEV    misc device (default /dev/ibmvsm)\n"
+		"  -n N      number of sessions (default 1)\n"
+		"  -s ID     session id of the first session, the others follow\n"
+		"  -p ID     partition id\n"
+		"  -m MODE   throughput or latency (default throughput)\n"
+		"  -t SEC    duration in seconds (default 5)\n"
+		"  -b BYTES  read and write size for throughput (default 4096)\n"
+		"  -l BYTES  message size for latency (default 16)\n"
+		"  -S FILE   adapter stats file, for hcall counts (default\n"
+		"            /sys/kernel/debug/ibmvsm/<device name>/stats)\n"
+		"  -M        throughput through the mapped rings\n"
+		"  -L        loopback, use in-process echo partners, no device\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct hcall_counts hc0, hc1;
+	uint64_t tx = 0, rx = 0, syscalls = 0, mismatches = 0, timeouts = 0;
+	uint64_t *samples = NULL, start, elapsed;
+	double cpu0, cpu1, sys0, sys1, secs, mb;
+	size_t nr_samples = 0;
+	struct session *s;
+	char stats[256];
+	unsigned int i;
+	int c, rc = 0;
+
+	while ((c = getopt(argc, argv, "d:n:s:p:m:t:b:l:S:ML")) != -1) {
+		switch (c) {
+		case 'd':
+			opt.device = optarg;
+			break;
+		case 'n':
+			opt.sessions = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			opt.session_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			opt.partition_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "throughput"))
+				opt.mode = MODE_THROUGHPUT;
+			else if (!strcmp(optarg, "latency"))
+				opt.mode = MODE_LATENCY;
+			else
+				usage(argv[0]);
+			break;
+		case 't':
+			opt.seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			opt.block = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			opt.msg = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			opt.stats_path = optarg;
+			break;
+		case 'M':
+			opt.mapped = 1;
+			break;
+		case 'L':
+			opt.loopback = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!opt.sessions || !opt.seconds || !opt.block || !opt.msg)
+		usage(argv[0]);
+
+	/* Only the driver has rings to map */
+	if (opt.mapped && (opt.loopback || opt.mode != MODE_THROUGHPUT))
+		usage(argv[0]);
+
+	if (!opt.stats_path && !opt.loopback) {
+		const char *name = strrchr(opt.device, '/');
+
+		snprintf(stats, sizeof(stats),
+			 "/sys/kernel/debug/ibmvsm/%s/stats",
+			 name ? name + 1 : opt.device);
+		opt.stats_path = stats;
+	}
+
+	s = calloc(opt.sessions, sizeof(*s));
+	if (!s)
+		return 1;
+
+	for (i = 0; i < opt.sessions; i++)
+		s[i].fd = s[i].peer = -1;
+
+	for (i = 0; i < opt.sessions; i++) {
+		rc = session_open(&s[i], i);
+		if (rc) {
+			fprintf(stderr, "session %u: %s\n", i, strerror(-rc));
+			goto close;
+		}
+	}
+
+	read_hcalls(&hc0);
+	cpu0 = process_busy();
+	sys0 = system_busy();
+	start = now_ns();
+	deadline = start + opt.seconds * NSEC_PER_SEC;
+
+	for (i = 0; i < opt.sessions; i++)
+		pthread_create(&s[i].thread, NULL,
+			       opt.mode == MODE_LATENCY ? latency_thread :
+			       opt.mapped ? throughput_mapped_thread :
+					    throughput_thread,
+			       &s[i]);
+	for (i = 0; i < opt.sessions; i++)
+		pthread_join(s[i].thread, NULL);
+
+	elapsed = now_ns() - start;
+	cpu1 = process_busy();
+	sys1 = system_busy();
+	read_hcalls(&hc1);
+
+	for (i = 0; i < opt.sessions; i++) {
+		tx += s[i].tx_bytes;
+		rx += s[i].rx_bytes;
+		syscalls += s[i].syscalls;
+		mismatches += s[i].mismatches;
+		timeouts += s[i].timeouts;
+		nr_samples += s[i].nr_samples;
+		if (s[i].error) {
+			fprintf(stderr, "session %u: %s\n", i,
+				strerror(s[i].error));
+			rc = 1;
+		}
+	}
+
+	samples = malloc((nr_samples + 1) * sizeof(*samples));
+	if (!samples) {
+		rc = 1;
+		goto close;
+	}
+	nr_samples = 0;
+	for (i = 0; i < opt.sessions; i++) {
+		memcpy(samples + nr_samples, s[i].samples,
+		       s[i].nr_samples * sizeof(*samples));
+		nr_samples += s[i].nr_samples;
+	}
+	qsort(samples, nr_samples, sizeof(*samples), cmp_u64);
+
+	secs = (double)elapsed / NSEC_PER_SEC;
+	mb = (double)(tx + rx) / 1e6;
+
+	printf("{\n");
+	printf("  \"mode\": \"%s\",\n",
+	       opt.mode == MODE_LATENCY ? "latency" : "throughput");
+	printf("  \"device\": \"%s\",\n",
+	       opt.loopback ? "loopback" : opt.device);
+	printf("  \"mapped\": %s,\n", opt.mapped ? "true" : "false");
+	printf("  \"sessions\": %u,\n", opt.sessions);
+	printf("  \"io_size\": %zu,\n",
+	       opt.mode == MODE_LATENCY ? opt.msg : opt.block);
+	printf("  \"seconds\": %.3f,\n", secs);
+	printf("  \"tx_bytes\": %" PRIu64 ",\n", tx);
+	printf("  \"rx_bytes\": %" PRIu64 ",\n", rx);
+	printf("  \"tx_mb_per_sec\": %.3f,\n", tx / secs / 1e6);
+	printf("  \"rx_mb_per_sec\": %.3f,\n", rx / secs / 1e6);
+	printf("  \"mismatched_bytes\": %" PRIu64 ",\n", mismatches);
+	printf("  \"round_trips\": %zu,\n", nr_samples);
+	printf("  \"round_trip_timeouts\": %" PRIu64 ",\n", timeouts);
+	printf("  \"rtt_p50_ns\": %" PRIu64 ",\n",
+	       percentile(samples, nr_samples, .5));
+	printf("  \"rtt_p99_ns\": %" PRIu64 ",\n",
+	       percentile(samples, nr_samples, .99));
+	printf("  \"rtt_p999_ns\": %" PRIu64 ",\n",
+	       percentile(samples, nr_samples, .999));
+	printf("  \"syscalls\": %" PRIu64 ",\n", syscalls);
+	print_per_byte("syscalls_per_byte", syscalls, tx + rx);
+	if (hc0.valid && hc1.valid) {
+		printf("  \"get_chars_hcalls\": %" PRIu64 ",\n",
+		       hc1.get_chars - hc0.get_chars);
+		printf("  \"put_chars_hcalls\": %" PRIu64 ",\n",
+		       hc1.put_chars - hc0.put_chars);
+		printf("  \"put_chars_busy\": %" PRIu64 ",\n",
+		       hc1.put_chars_busy - hc0.put_chars_busy);
+		print_per_byte("hcalls_per_byte",
+			       hc1.get_chars - hc0.get_chars +
+			       hc1.put_chars - hc0.put_chars, tx + rx);
+	} else {
+		printf("  \"hcalls_per_byte\": null,\n");
+	}
+	printf("  \"process_cpu_sec\": %.3f,\n", cpu1 - cpu0);
+	printf("  \"system_cpu_sec\": %.3f,\n", sys1 - sys0);
+	if (mb > 0) {
+		printf("  \"process_cpu_ms_per_mb\": %.3f,\n",
+		       (cpu1 - cpu0) * 1e3 / mb);
+		printf("  \"system_cpu_ms_per_mb\": %.3f\n",
+		       (sys1 - sys0) * 1e3 / mb);
+	} else {
+		printf("  \"process_cpu_ms_per_mb\": null,\n");
+		printf("  \"system_cpu_ms_per_mb\": null\n");
+	}
+	printf("}\n");
+
+close:
+	for (i = 0; i < opt.sessions; i++) {
+		session_close(&s[i]);
+		free(s[i].samples);
+	}
+	free(samples);
+	free(s);
+
+	return rc ? 1 : 0;
+}
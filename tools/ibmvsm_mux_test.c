@@ -0,0 +1,183 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * ibmvsm_mux_test - open and close multiplexed sessions in a loop
+ *
+ * Each iteration opens a multiplexed session on the ibmvsm misc device,
+ * adds one partner vterm with VSM_IOCTL_MUX_OPEN and takes it out again,
+ * alternating between VSM_IOCTL_MUX_CLOSE and closing the file with the
+ * member still in it. Once all files are closed the nr_open attribute of
+ * the VSM device must be back at 0, otherwise vterms have leaked and the
+ * test fails.
+ *
+ * Copyright (c) 2018 IBM Corp.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "ibmvsm_uapi.h"
+
+/* How long MUX_OPEN may keep failing while the adapter finishes resetting */
+#define OPEN_TIMEOUT_MS		5000
+#define OPEN_RETRY_MS		10
+
+static struct {
+	const char *device;
+	unsigned int iterations;
+	uint32_t session_id;
+	uint32_t partition_id;
+} opt = {
+	.device		= "/dev/ibmvsm",
+	.iterations	= 1000,
+};
+
+static int mux_open(int fd, struct ibmvsm_open_entry *entry)
+{
+	const struct timespec pause = {
+		.tv_nsec = OPEN_RETRY_MS * 1000000L,
+	};
+	unsigned int tries = OPEN_TIMEOUT_MS / OPEN_RETRY_MS;
+	struct ibmvsm_open_batch batch = {
+		.count		= 1,
+		.entries	= (uintptr_t)entry,
+	};
+
+	for (;;) {
+		entry->session_id = opt.session_id;
+		entry->partition_id = opt.partition_id;
+		entry->status = 0;
+		if (ioctl(fd, VSM_IOCTL_MUX_OPEN, &batch) < 0)
+			return -errno;
+		if (entry->status != -EAGAIN || !tries--)
+			return entry->status;
+		nanosleep(&pause, NULL);
+	}
+}
+
+static int mux_close(int fd, uint64_t token)
+{
+	struct ibmvsm_close_entry entry = {
+		.console_token	= token,
+	};
+	struct ibmvsm_close_batch batch = {
+		.count		= 1,
+		.entries	= (uintptr_t)&entry,
+	};
+
+	if (ioctl(fd, VSM_IOCTL_MUX_CLOSE, &batch) < 0)
+		return -errno;
+
+	return entry.status;
+}
+
+static long read_nr_open(void)
+{
+	char *dev = strdup(opt.device);
+	char path[256], buf[32];
+	ssize_t len;
+	int fd;
+
+	if (!dev)
+		return -ENOMEM;
+	snprintf(path, sizeof(path), "/sys/class/misc/%s/device/nr_open",
+		 basename(dev));
+	free(dev);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -errno;
+	}
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return len ? -errno : -EIO;
+	buf[len] = '\0';
+
+	return strtol(buf, NULL, 0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -d DEV    misc device (default /dev/ibmvsm)\n"
+		"  -n N      number of iterations (default 1000)\n"
+		"  -s ID     session id of the partner vterm\n"
+		"  -p ID     partition id\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct ibmvsm_open_entry entry;
+	unsigned int i;
+	long nr_open;
+	int c, fd, rc;
+
+	while ((c = getopt(argc, argv, "d:n:s:p:")) != -1) {
+		switch (c) {
+		case 'd':
+			opt.device = optarg;
+			break;
+		case 'n':
+			opt.iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			opt.session_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			opt.partition_id = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	for (i = 0; i < opt.iterations; i++) {
+		fd = open(opt.device, O_RDWR);
+		if (fd < 0) {
+			perror(opt.device);
+			return 1;
+		}
+
+		rc = mux_open(fd, &entry);
+		if (rc) {
+			fprintf(stderr, "iteration %u: MUX_OPEN: %s\n", i,
+				strerror(-rc));
+			close(fd);
+			return 1;
+		}
+
+		/* Every other member is left for the release of the file */
+		if (!(i & 1)) {
+			rc = mux_close(fd, entry.console_token);
+			if (rc) {
+				fprintf(stderr, "iteration %u: MUX_CLOSE: %s\n",
+					i, strerror(-rc));
+				close(fd);
+				return 1;
+			}
+		}
+
+		close(fd);
+	}
+
+	nr_open = read_nr_open();
+	if (nr_open < 0)
+		return 1;
+
+	printf("%u iterations, nr_open %ld\n", opt.iterations, nr_open);
+
+	return nr_open ? 1 : 0;
+}